@@ -0,0 +1,291 @@
+#!/bin/bash
+#
+# Throughput and latency benchmark for STP: "make bench".
+#
+# Every combination of BENCH_SIZES, BENCH_MTUS, BENCH_WINDOWS and
+# BENCH_PROFILES is a configuration. Each one is run BENCH_RUNS times,
+# with a fresh ReceiveAppL and SendAppL, and the received file is
+# checked. The results go to bench.json, one configuration per line:
+#
+#   goodput_mbps    file data per second of the median run
+#   retrans_ratio   retransmitted segments / segments sent
+#   cpu_s_per_gb    sender plus receiver CPU (user + sys) per GB
+#   ct_p50_ms ...   completion time percentiles of the sender
+#   failures        runs that did not deliver the file intact
+#
+# If BENCH_BASELINE (bench_baseline.json) exists, each configuration
+# is compared with it, and a goodput drop or a p50 completion time
+# rise of more than BENCH_TOLERANCE percent is a regression; the exit
+# status is 1 if there is one. "bench.sh save" (make bench-baseline)
+# stores the results as the new baseline instead.
+#
+# A profile is "lo" or "netem", followed by ":key=value" settings:
+# rtt (ms), loss and reorder (probabilities). On "lo" the transfer
+# goes over loopback and the receiver simulates loss and reordering
+# itself; rtt needs netem. A "netem" profile runs the sender and the
+# receiver in two network namespaces joined by a veth pair, with
+# netem adding the delay on both sides and loss and reordering on the
+# data path. That needs root and the sch_netem module; without them
+# those profiles are skipped.
+#
+# BENCH_SEND_ARGS and BENCH_RECV_ARGS are passed on to the programs.
+#
+
+cd "$(dirname "$0")" || exit 1
+TOP=$(pwd)
+
+SIZES=${BENCH_SIZES:-"1M 16M"}
+MTUS=${BENCH_MTUS:-"1472 9000"}
+WINDOWS=${BENCH_WINDOWS:-"262144"}
+PROFILES=${BENCH_PROFILES:-"lo lo:loss=0.01 lo:reorder=0.01 netem:rtt=10 netem:rtt=50:loss=0.01 netem:rtt=20:reorder=0.05"}
+RUNS=${BENCH_RUNS:-5}
+TIMEOUT=${BENCH_TIMEOUT:-120}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+OUT=${BENCH_OUT:-bench.json}
+BASELINE=${BENCH_BASELINE:-bench_baseline.json}
+
+NS_S=stpbench_s
+NS_R=stpbench_r
+ADDR_S=10.77.0.1
+ADDR_R=10.77.0.2
+
+WORK=$(mktemp -d /tmp/stpbench.XXXXXX) || exit 1
+PORT=${BENCH_PORT:-47000}   # the receiver's; the sender's is the next one
+NETEM=no            # the namespaces are set up
+
+cleanup()
+{
+  if [ "$NETEM" = yes ]; then
+    ip netns del $NS_S 2>/dev/null
+    ip netns del $NS_R 2>/dev/null
+  fi
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+# "16M" and the like to bytes
+bytes()
+{
+  case $1 in
+    *K) echo $(( ${1%K} * 1024 )) ;;
+    *M) echo $(( ${1%M} * 1024 * 1024 )) ;;
+    *G) echo $(( ${1%G} * 1024 * 1024 * 1024 )) ;;
+    *)  echo "$1" ;;
+  esac
+}
+
+# Two namespaces and a veth pair between them, with netem on it
+netem_setup()
+{
+  local mtu=1500 m
+
+  for m in $MTUS; do
+    [ $((m + 28)) -gt $mtu ] && mtu=$((m + 28))
+  done
+  if ip netns add $NS_S 2>/dev/null && ip netns add $NS_R 2>/dev/null &&
+     ip link add stpbench0 netns $NS_S type veth peer name stpbench1 netns $NS_R &&
+     ip -n $NS_S addr add $ADDR_S/24 dev stpbench0 &&
+     ip -n $NS_R addr add $ADDR_R/24 dev stpbench1 &&
+     ip -n $NS_S link set stpbench0 mtu $mtu up &&
+     ip -n $NS_R link set stpbench1 mtu $mtu up &&
+     ip netns exec $NS_S tc qdisc add dev stpbench0 root netem delay 1ms 2>/dev/null; then
+    NETEM=yes
+    return 0
+  fi
+  echo "bench: no network namespaces with netem here, skipping the netem profiles" >&2
+  ip netns del $NS_S 2>/dev/null
+  ip netns del $NS_R 2>/dev/null
+  return 1
+}
+
+# netem for one profile: half the RTT each way, impairments on the data path
+netem_profile()
+{
+  local half=$(awk -v r="$1" 'BEGIN { printf "%.3f", r / 2 }')
+  local data="delay ${half}ms"
+
+  [ "$2" != 0 ] && data="$data loss $(awk -v p="$2" 'BEGIN { print p * 100 }')%"
+  [ "$3" != 0 ] && data="$data reorder $(awk -v p="$3" 'BEGIN { print p * 100 }')%"
+  ip netns exec $NS_S tc qdisc replace dev stpbench0 root netem $data &&
+  ip netns exec $NS_R tc qdisc replace dev stpbench1 root netem delay ${half}ms
+}
+
+#
+# One transfer. Prints "ms segments retransmitted cpu_seconds", or
+# nothing if it failed.
+#
+run_once()
+{
+  local kind=$1 file=$2 mtu=$3 win=$4 loss=$5 reorder=$6
+  local dir=$WORK/run rport=$PORT sport=$((PORT + 1)) t0 t1 sst rst sexec rexec shost rhost
+  local rprobs=""
+
+  rm -rf "$dir"; mkdir -p "$dir"
+
+  if [ "$kind" = netem ]; then
+    sexec="ip netns exec $NS_S"; rexec="ip netns exec $NS_R"
+    shost=$ADDR_S; rhost=$ADDR_R
+  else
+    sexec=""; rexec=""; shost=127.0.0.1; rhost=127.0.0.1
+    rprobs="$loss 0 $reorder"
+  fi
+
+  (
+    cd "$dir" || exit 1
+    TIMEFORMAT='cpu %3U %3S'
+    time $rexec timeout $TIMEOUT "$TOP/ReceiveAppL" -L 1 -m $mtu -w $win $BENCH_RECV_ARGS \
+      $shost $rport $sport $rprobs > recv.log 2>&1
+    echo "status $?"
+  ) > "$dir/recv.time" 2>&1 &
+  sleep 0.2
+
+  t0=$(date +%s%N)
+  (
+    TIMEFORMAT='cpu %3U %3S'
+    time $sexec timeout $TIMEOUT "$TOP/SendAppL" -L 1 -m $mtu -w $win $BENCH_SEND_ARGS \
+      $rhost $sport $rport "$file" > "$dir/send.log" 2>&1
+    echo "status $?"
+  ) > "$dir/send.time" 2>&1
+  t1=$(date +%s%N)
+  wait
+
+  sst=$(awk '/^status/ { print $2 }' "$dir/send.time")
+  rst=$(awk '/^status/ { print $2 }' "$dir/recv.time")
+  [ "$sst" = 0 ] && [ "$rst" = 0 ] && cmp -s "$file" "$dir/OutputFile" || return
+
+  awk -v ms=$(( (t1 - t0) / 1000000 )) '
+    /^sender: / { sent += $2; retrans += $5 }
+    /^cpu /     { cpu += $2 + $3 }
+    END         { printf "%d %d %d %.3f\n", ms, sent, retrans, cpu }
+  ' "$dir/send.log" "$dir/send.time" "$dir/recv.time"
+}
+
+#
+# All the runs of one configuration, as a line of JSON.
+#
+run_config()
+{
+  local size=$1 mtu=$2 win=$3 profile=$4
+  local kind=${profile%%:*} rtt=0 loss=0 reorder=0 kv name
+  local file=$WORK/in.$size n=0 fails=0 line results=""
+
+  for kv in $(echo "${profile#$kind}" | tr ':' ' '); do
+    case $kv in
+      rtt=*) rtt=${kv#rtt=} ;;
+      loss=*) loss=${kv#loss=} ;;
+      reorder=*) reorder=${kv#reorder=} ;;
+      *) echo "bench: unknown profile setting $kv" >&2; return 1 ;;
+    esac
+  done
+  case $kind in
+    lo)
+      if [ "$rtt" != 0 ]; then
+        echo "bench: $profile: rtt needs netem" >&2; return 1
+      fi ;;
+    netem)
+      [ "$NETEM" = yes ] || return 0
+      netem_profile $rtt $loss $reorder || return 1 ;;
+    *) echo "bench: unknown profile $profile" >&2; return 1 ;;
+  esac
+
+  [ -f "$file" ] || head -c $(bytes $size) /dev/urandom > "$file"
+  name="$kind-rtt$rtt-loss$loss-reorder$reorder-size$size-mtu$mtu-win$win"
+  echo "bench: $name" >&2
+
+  while [ $n -lt $RUNS ]; do
+    n=$((n + 1))
+    if line=$(run_once $kind "$file" $mtu $win $loss $reorder) && [ -n "$line" ]; then
+      results="$results$line"$'\n'
+    else
+      fails=$((fails + 1))
+    fi
+  done
+
+  printf '%s' "$results" | sort -n | awk -v name="$name" -v path=$kind -v size=$(bytes $size) \
+    -v mtu=$mtu -v win=$win -v rtt=$rtt -v loss=$loss -v reorder=$reorder \
+    -v runs=$RUNS -v fails=$fails '
+    function pct(p,  i) { i = int(p * n / 100 + 0.999); if (i < 1) i = 1; return ms[i] }
+    NF == 4 { n++; ms[n] = $1; sent += $2; retrans += $3; cpu += $4 }
+    END {
+      printf "    {\"name\": \"%s\", \"path\": \"%s\", \"size\": %d, \"mtu\": %d, \"window\": %d, ", name, path, size, mtu, win
+      printf "\"rtt_ms\": %s, \"loss\": %s, \"reorder\": %s, \"runs\": %d, \"failures\": %d", rtt, loss, reorder, runs, fails
+      if (n > 0) {
+        p50 = pct(50) > 0 ? pct(50) : 1
+        ratio = sent > 0 ? retrans / sent : 0
+        printf ", \"goodput_mbps\": %.2f, \"retrans_ratio\": %.5f, \"cpu_s_per_gb\": %.3f, \"ct_p50_ms\": %d, \"ct_p90_ms\": %d, \"ct_p99_ms\": %d",
+          size * 8 / p50 / 1000, ratio, cpu / (n * size / 1e9), pct(50), pct(90), pct(99)
+      }
+      printf "}"
+    }'
+}
+
+#
+# Compare the results with the baseline, configuration by configuration.
+#
+compare()
+{
+  awk -v tol=$TOLERANCE '
+    function field(line, key,  m) {
+      if (match(line, "\"" key "\": [^,}]*")) {
+        m = substr(line, RSTART, RLENGTH); sub(/^[^:]*: */, "", m); gsub(/"/, "", m); return m
+      }
+      return ""
+    }
+    /"name"/ {
+      name = field($0, "name")
+      if (FILENAME == ARGV[1]) { bg[name] = field($0, "goodput_mbps"); bt[name] = field($0, "ct_p50_ms"); next }
+      g = field($0, "goodput_mbps"); t = field($0, "ct_p50_ms")
+      if (!(name in bg) || bg[name] == "" || g == "") {
+        printf "%-60s %s\n", name, g == "" ? "FAILED" : "no baseline"
+        if (g == "" && bg[name] != "") bad++
+        next
+      }
+      dg = bg[name] > 0 ? (g - bg[name]) * 100 / bg[name] : 0
+      dt = bt[name] > 0 ? (t - bt[name]) * 100 / bt[name] : 0
+      verdict = (dg < -tol || dt > tol) ? "REGRESSION" : (dg > tol ? "better" : "same")
+      if (verdict == "REGRESSION") bad++
+      printf "%-60s goodput %9.2f -> %9.2f Mbit/s (%+6.1f%%)  p50 %6d -> %6d ms (%+6.1f%%)  %s\n",
+        name, bg[name], g, dg, bt[name], t, dt, verdict
+    }
+    END { exit bad > 0 }
+  ' "$BASELINE" "$OUT"
+}
+
+if [ ! -x ./SendAppL ] || [ ! -x ./ReceiveAppL ]; then
+  echo "bench: build with \"make Linux\" first" >&2
+  exit 1
+fi
+
+case " $PROFILES" in
+  *" netem"*) netem_setup ;;
+esac
+
+{
+  printf '{\n  "host": "%s", "date": "%s", "cpus": %d,\n' \
+    "$(uname -n)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(getconf _NPROCESSORS_ONLN)"
+  printf '  "results": [\n'
+  sep=""
+  for profile in $PROFILES; do
+    for size in $SIZES; do
+      for mtu in $MTUS; do
+        for win in $WINDOWS; do
+          line=$(run_config $size $mtu $win $profile) || exit 1
+          [ -z "$line" ] && continue
+          printf '%s%s' "$sep" "$line"
+          sep=$',\n'
+        done
+      done
+    done
+  done
+  printf '\n  ]\n}\n'
+} > "$OUT.tmp" && mv "$OUT.tmp" "$OUT" || { rm -f "$OUT.tmp"; exit 1; }
+echo "bench: results in $OUT" >&2
+
+if [ "$1" = save ]; then
+  cp "$OUT" "$BASELINE" && echo "bench: saved as the baseline, $BASELINE" >&2
+elif [ -f "$BASELINE" ]; then
+  compare
+else
+  echo "bench: no baseline to compare with; \"make bench-baseline\" stores one" >&2
+fi
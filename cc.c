@@ -0,0 +1,278 @@
+/*
+ * Congestion control for the STP sender.
+ *
+ * Every algorithm is a table of callbacks (stp_cc_ops) that the
+ * sender invokes when new data is acknowledged, when a loss is
+ * detected while ACKs are still arriving, and when a retransmission
+ * timer expires. The algorithm keeps cwnd in bytes; the sender never
+ * has more than min(cwnd, advertised window) in flight.
+ *
+ * Two algorithms are provided: NewReno-style AIMD (RFC 5681) and
+ * CUBIC (RFC 8312). Both share slow start and the reaction to a
+ * timeout; they differ in how cwnd grows in congestion avoidance and
+ * how far it is cut on a loss.
+ *
+ * Whatever the algorithm, cwnd only grows while the connection is
+ * using it (RFC 7661): a flow held back by the receive window or by
+ * the application would otherwise raise cwnd on every ACK to a value
+ * the path was never shown to carry. It never grows beyond the
+ * sender's own maximum window either.
+ */
+
+#include <string.h>
+#include "stp.h"
+
+#define CC_INITIAL_SSTHRESH 0x7fffffff
+
+static unsigned int cc_max(unsigned int a, unsigned int b)
+{
+  return a > b ? a : b;
+}
+
+/*
+ * Initial window of RFC 6928: ten segments, but no more than 14600
+ * bytes unless that is less than two segments.
+ */
+static unsigned int cc_initial_window(int mss)
+{
+  unsigned int iw = 10 * mss;
+
+  if (iw > cc_max(2 * mss, 14600))
+    iw = cc_max(2 * mss, 14600);
+  return iw;
+}
+
+/*
+ * Slow start: grow by the bytes acknowledged, at most two segments per
+ * ACK (appropriate byte counting, RFC 3465). Returns the part of
+ * "acked" left over once cwnd reaches ssthresh.
+ */
+static unsigned int cc_slow_start(stp_cc *cc, unsigned int acked)
+{
+  unsigned int grow = acked < 2 * (unsigned int) cc->mss ? acked : 2 * cc->mss;
+
+  if (cc->cwnd + grow > cc->ssthresh)
+    grow = cc->ssthresh > cc->cwnd ? cc->ssthresh - cc->cwnd : 0;
+  cc->cwnd += grow;
+  return acked - grow;
+}
+
+/*
+ * After a timeout nothing is known about the path any more: remember
+ * half of what was in flight as ssthresh and start again from one
+ * segment.
+ */
+static void cc_timeout_common(stp_cc *cc, unsigned int inFlight)
+{
+  cc->ssthresh = cc_max(inFlight / 2, 2 * cc->mss);
+  cc->cwnd = cc->mss;
+  cc->bytesAcked = 0;
+  cc->timeouts++;
+}
+
+
+/* NewReno: additive increase, multiplicative decrease */
+
+static void newreno_init(stp_cc *cc)
+{
+}
+
+static void newreno_ack(stp_cc *cc, unsigned int acked, int srtt, long long now)
+{
+  if (cc->cwnd < cc->ssthresh)
+    acked = cc_slow_start(cc, acked);
+
+  /* One segment per window's worth of acknowledged bytes */
+  cc->bytesAcked += acked;
+  if (cc->bytesAcked >= cc->cwnd)
+    {
+      cc->bytesAcked -= cc->cwnd;
+      cc->cwnd += cc->mss;
+    }
+}
+
+static void newreno_loss(stp_cc *cc, unsigned int inFlight, long long now)
+{
+  cc->ssthresh = cc_max(inFlight / 2, 2 * cc->mss);
+  cc->cwnd = cc->ssthresh;
+  cc->bytesAcked = 0;
+  cc->losses++;
+}
+
+static void newreno_timeout(stp_cc *cc, unsigned int inFlight, long long now)
+{
+  cc_timeout_common(cc, inFlight);
+}
+
+
+/* CUBIC: the window follows a cubic function of the time since the last loss */
+
+#define CUBIC_C    0.4   /* scaling constant, segments / s^3 */
+#define CUBIC_BETA 0.7   /* multiplicative decrease */
+
+/* Cube root by Newton's method, so we do not need libm */
+static double cubic_root(double x)
+{
+  double r = x > 1.0 ? x / 3.0 : 1.0;
+  int i;
+
+  if (x <= 0.0)
+    return 0.0;
+  for (i = 0; i < 40; i++)
+    r -= (r * r * r - x) / (3.0 * r * r);
+  return r;
+}
+
+static void cubic_init(stp_cc *cc)
+{
+  cc->wMax = 0;
+  cc->wLastMax = 0;
+  cc->epochStart = 0;
+}
+
+static void cubic_ack(stp_cc *cc, unsigned int acked, int srtt, long long now)
+{
+  double mss = cc->mss, cwnd, t, target, wEst, rtt;
+
+  if (cc->cwnd < cc->ssthresh)
+    {
+      acked = cc_slow_start(cc, acked);
+      if (acked == 0)
+        return;
+    }
+
+  /* Everything below is in segments and seconds, as in RFC 8312 */
+  cwnd = cc->cwnd / mss;
+  rtt = (srtt > 0 ? srtt : 1) / 1000.0;
+
+  if (cc->epochStart == 0)
+    {
+      cc->epochStart = now;
+      cc->wEst = cwnd;
+      if (cwnd < cc->wMax)
+        {
+          cc->k = cubic_root(cc->wMax * (1.0 - CUBIC_BETA) / CUBIC_C);
+          cc->origin = cc->wMax;
+        }
+      else
+        {
+          cc->k = 0;
+          cc->origin = cwnd;
+        }
+    }
+
+  t = (now - cc->epochStart) / 1000.0 + rtt;
+  target = cc->origin + CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k);
+
+  /* The window standard AIMD would have reached; never do worse */
+  cc->wEst += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * (acked / mss) / cwnd;
+  wEst = cc->wEst;
+  if (target < wEst)
+    target = wEst;
+
+  /* Approach the target over one RTT, at most half a window per RTT above it */
+  if (target > 1.5 * cwnd)
+    target = 1.5 * cwnd;
+  if (target > cwnd)
+    {
+      cc->bytesAcked += (unsigned int) ((target - cwnd) / cwnd * acked);
+      if (cc->bytesAcked >= (unsigned int) cc->mss)
+        {
+          cc->cwnd += cc->bytesAcked;
+          cc->bytesAcked = 0;
+        }
+    }
+}
+
+static void cubic_reduce(stp_cc *cc)
+{
+  double cwnd = cc->cwnd / (double) cc->mss;
+
+  /* Fast convergence: give up bandwidth to newer flows */
+  if (cwnd < cc->wLastMax)
+    cc->wMax = cwnd * (1.0 + CUBIC_BETA) / 2.0;
+  else
+    cc->wMax = cwnd;
+  cc->wLastMax = cwnd;
+  cc->epochStart = 0;
+  cc->bytesAcked = 0;
+}
+
+static void cubic_loss(stp_cc *cc, unsigned int inFlight, long long now)
+{
+  cubic_reduce(cc);
+  cc->ssthresh = cc_max((unsigned int) (cc->cwnd * CUBIC_BETA), 2 * cc->mss);
+  cc->cwnd = cc->ssthresh;
+  cc->losses++;
+}
+
+static void cubic_timeout(stp_cc *cc, unsigned int inFlight, long long now)
+{
+  cubic_reduce(cc);
+  cc_timeout_common(cc, inFlight);
+}
+
+
+static const stp_cc_ops stp_cc_algorithms[] = {
+  { "newreno", newreno_init, newreno_ack, newreno_loss, newreno_timeout },
+  { "cubic", cubic_init, cubic_ack, cubic_loss, cubic_timeout },
+};
+
+#define NUM_ALGORITHMS ((int) (sizeof(stp_cc_algorithms) / sizeof(stp_cc_algorithms[0])))
+
+/*
+ * Look an algorithm up by name ("aimd" is another name for NewReno).
+ * Returns NULL if there is no such algorithm.
+ */
+const stp_cc_ops *stp_cc_find(const char *name)
+{
+  int i;
+
+  if (strcmp(name, "aimd") == 0)
+    name = "newreno";
+  for (i = 0; i < NUM_ALGORITHMS; i++)
+    if (strcmp(stp_cc_algorithms[i].name, name) == 0)
+      return &stp_cc_algorithms[i];
+  return NULL;
+}
+
+/*
+ * Start congestion control for a connection that sends mss-byte
+ * segments and never has more than maxWin bytes in flight.
+ */
+void stp_cc_init(stp_cc *cc, const stp_cc_ops *ops, int mss, unsigned int maxWin)
+{
+  memset(cc, 0, sizeof(*cc));
+  cc->ops = ops;
+  cc->mss = mss;
+  cc->maxCwnd = cc_max(maxWin, 2 * mss);
+  cc->cwnd = cc_initial_window(mss);
+  if (cc->cwnd > cc->maxCwnd)
+    cc->cwnd = cc->maxCwnd;
+  cc->ssthresh = CC_INITIAL_SSTHRESH;
+  ops->init(cc);
+}
+
+/*
+ * "acked" bytes of new data were acknowledged with inFlight bytes in
+ * flight, those included. Unless the flow was using at least half of
+ * cwnd (the pipeACK test of RFC 7661) the algorithm is not told, so
+ * cwnd stays where it is; what it does grow to is capped by maxCwnd.
+ */
+void stp_cc_ack(stp_cc *cc, unsigned int acked, unsigned int inFlight, int srtt, long long now)
+{
+  if (inFlight < cc->cwnd / 2)
+    return;
+  cc->ops->on_ack(cc, acked, srtt, now);
+  if (cc->cwnd > cc->maxCwnd)
+    cc->cwnd = cc->maxCwnd;
+}
+
+/*
+ * ssthresh for the statistics: 0 while it is still the initial one,
+ * which is no threshold at all.
+ */
+unsigned int stp_cc_ssthresh(stp_cc *cc)
+{
+  return cc->ssthresh == CC_INITIAL_SSTHRESH ? 0 : cc->ssthresh;
+}
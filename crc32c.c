@@ -0,0 +1,190 @@
+/*
+ * CRC32C (Castagnoli) for STP.
+ *
+ * The v2 header can be protected by CRC32C instead of the byte sum.
+ * Two implementations are here: the SSE4.2 crc32 instruction, eight
+ * bytes at a time, and a portable table-driven slice-by-8 for every
+ * other CPU. Which one runs is decided once, under pthread_once(), the
+ * first time a CRC is computed or the implementation asked for, and
+ * stays that way for the life of the process. A candidate is only
+ * used if it gives the known answer for "123456789".
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "stp.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STP_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78  /* reflected Castagnoli polynomial */
+#define CRC32C_CHECK 0xe3069283 /* CRC32C of "123456789" */
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t crc32c_table[8][256];
+
+/* The implementation in use, set by crc32c_resolve() */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_fn crc32c_impl;
+static const char *crc32c_name;
+
+static void crc32c_init_tables(void)
+{
+  uint32_t i, j, crc;
+
+  for (i = 0; i < 256; i++)
+    {
+      crc = i;
+      for (j = 0; j < 8; j++)
+        crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+      crc32c_table[0][i] = crc;
+    }
+  for (i = 0; i < 256; i++)
+    for (j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+        crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+/*
+ * Slice-by-8: eight table lookups fold eight bytes into the CRC per
+ * step, instead of one lookup per byte.
+ */
+static uint32_t crc32c_slice8(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len > 0 && ((uintptr_t) p & 7) != 0)
+    {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+      len--;
+    }
+
+  while (len >= 8)
+    {
+      uint32_t lo, hi;
+
+      memcpy(&lo, p, 4);
+      memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      lo = __builtin_bswap32(lo);
+      hi = __builtin_bswap32(hi);
+#endif
+      lo ^= crc;
+      crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+        crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+        crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+        crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+      p += 8;
+      len -= 8;
+    }
+
+  while (len-- > 0)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(STP_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len > 0 && ((uintptr_t) p & 7) != 0)
+    {
+      crc = _mm_crc32_u8(crc, *p++);
+      len--;
+    }
+
+#if defined(__x86_64__)
+  {
+    uint64_t crc64 = crc;
+
+    while (len >= 8)
+      {
+        uint64_t word;
+
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+      }
+    crc = (uint32_t) crc64;
+  }
+#endif
+
+  while (len >= 4)
+    {
+      uint32_t word;
+
+      memcpy(&word, p, 4);
+      crc = _mm_crc32_u32(crc, word);
+      p += 4;
+      len -= 4;
+    }
+
+  while (len-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+/*
+ * Whether fn gives the known answer, both over the whole check string
+ * and fed in two pieces that start at different alignments.
+ */
+static int crc32c_good(crc32c_fn fn)
+{
+  static const unsigned char check[] = "123456789";
+
+  return ~fn(~0u, check, 9) == CRC32C_CHECK &&
+    ~fn(fn(~0u, check, 3), check + 3, 6) == CRC32C_CHECK;
+}
+
+/*
+ * Pick the fastest implementation the CPU supports that gives the
+ * right answer. Runs once, through crc32c_once.
+ */
+static void crc32c_resolve(void)
+{
+  crc32c_init_tables();
+  crc32c_impl = crc32c_slice8;
+  crc32c_name = "slice-by-8";
+  if (!crc32c_good(crc32c_slice8))
+    stp_log(STP_LOG_ERROR, "crc32c: slice-by-8 fails its known answer test\n");
+
+#if defined(STP_CRC32C_SSE42)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    {
+      if (crc32c_good(crc32c_sse42))
+        {
+          crc32c_impl = crc32c_sse42;
+          crc32c_name = "sse4.2";
+        }
+      else
+        stp_log(STP_LOG_ERROR, "crc32c: sse4.2 fails its known answer test, using slice-by-8\n");
+    }
+#endif
+}
+
+/*
+ * Continue the CRC32C "crc" (0 to start a new one) over len bytes at
+ * buf. Feeding the data in pieces gives the same result as feeding
+ * it at once.
+ */
+unsigned int stp_crc32c(unsigned int crc, const void *buf, int len)
+{
+  pthread_once(&crc32c_once, crc32c_resolve);
+  return ~crc32c_impl(~crc, (const unsigned char *) buf, len);
+}
+
+/*
+ * Name of the implementation in use, for the log.
+ */
+const char *stp_crc32c_impl(void)
+{
+  pthread_once(&crc32c_once, crc32c_resolve);
+  return crc32c_name;
+}
@@ -0,0 +1,128 @@
+/*
+ * libstp: the sending side of STP as a library (libstpL.a and
+ * libstpL.so, or the S variants on Solaris).
+ *
+ * The calls below never wait. A connection is driven by its caller's
+ * own event loop:
+ *
+ *   stp_connect()   sends the SYN and returns at once.
+ *   stp_fd()        is the socket; watch it for input.
+ *   stp_timeout()   is how many ms may pass before stp_process() has
+ *                   to be called anyway, -1 if there is no deadline.
+ *   stp_process()   reads whatever has arrived and runs the timers
+ *                   that are due. Call it when the socket is readable
+ *                   and when the timeout has passed.
+ *   stp_write()     queues as much of the data as the window lets go
+ *                   now and returns how much that was, or
+ *                   STP_WOULD_BLOCK if it was nothing. Try again after
+ *                   the next stp_process().
+ *   stp_shutdown()  sends the FIN once all the data is acknowledged;
+ *                   it returns STP_WOULD_BLOCK until the FIN is, then
+ *                   STP_OK.
+ *   stp_free()      releases the connection, in any state.
+ *   stp_stats()     copies out its counters; nothing here prints them.
+ *
+ * Errors are returned as the negative STP_ERR_ codes; once a
+ * connection has failed, every call returns the same code.
+ * stp_conn_strerror() describes it, with the errno of the socket
+ * call that failed saved when it did; if stp_connect() itself fails
+ * there is no connection, and errno is still that call's. Each
+ * connection is configured by the stp_sender_config passed to
+ * stp_connect(), which it copies, so connections in one process can
+ * differ and nothing is shared between them. Start a configuration
+ * with stp_config_defaults(). Only the log level (stp_log_level) is
+ * process-wide.
+ *
+ * stp_open(), stp_send() and stp_close() are the blocking calls that
+ * SendApp uses. They return NULL or STP_ERROR on failure.
+ * stp_close_stats() also hands back the final counters.
+ *
+ * Only the sender is a library; the receiver is ReceiveApp.
+ */
+
+#ifndef __LIBSTP_H_
+
+#define __LIBSTP_H_
+
+/* Results of the blocking calls */
+#define STP_SUCCESS 1
+#define STP_ERROR -1
+
+/* Results of the nonblocking calls */
+#define STP_OK 0
+#define STP_WOULD_BLOCK (-10)   /* nothing could be done now, try again later */
+#define STP_ERR_RESET   (-11)   /* the receiver reset the connection */
+#define STP_ERR_TIMEOUT (-12)   /* the receiver stopped answering */
+#define STP_ERR_SOCKET  (-13)   /* a socket call failed, stp_conn_strerror() says why */
+#define STP_ERR_NOMEM   (-14)   /* out of memory */
+#define STP_ERR_ADDRESS (-15)   /* no such destination host */
+#define STP_ERR_STATE   (-16)   /* not possible in this state of the connection */
+#define STP_ERR_CONFIG  (-17)   /* a setting of the stp_sender_config is out of range */
+
+typedef struct stp_send_ctrl_blk_tag stp_send_ctrl_blk;
+
+/* Settings of a connection, see stp_connect() */
+typedef struct {
+  int maxWin;                 /* maximum window size (bytes) */
+  int rtoMinMs;               /* floor of the retransmission timeout */
+  int rtoMaxMs;               /* ceiling of the retransmission timeout */
+  int maxRetries;             /* timeouts in a row before we give up */
+  int zeroCopy;               /* MSG_ZEROCOPY for large segments, only with segmentCopy 0 */
+  int maxMtu;                 /* largest packet we offer to send */
+  int pathMtu;                /* also bound the MTU by the path MTU (DF set) */
+  int maxVersion;             /* newest wire version we offer */
+  int crc32c;                 /* offer CRC32C checksums (v2) */
+  const char *congestion;     /* congestion control algorithm: "newreno", "cubic" */
+  double maxRate;             /* pacing cap in bytes per us, 0 for none */
+  int txTime;                 /* hand departure times to the kernel (SO_TXTIME) */
+  int segmentCopy;            /* 0: only stp_write_mapped(), segments need no copy */
+} stp_sender_config;
+
+/* Counters of a connection, see stp_stats() */
+typedef struct {
+  unsigned long segsSent;     /* segments put on the wire, retransmissions included */
+  unsigned long segsRetrans;  /* of those, retransmissions */
+  const char *cc;             /* congestion control algorithm, NULL before the SYN-ACK */
+  unsigned int cwnd;          /* congestion window (bytes) */
+  unsigned int ssthresh;      /* slow start threshold (bytes), 0 before the first loss */
+  unsigned long losses;       /* losses that cut cwnd */
+  unsigned long timeouts;     /* retransmission timeouts that cut cwnd */
+  int poolBuffers;            /* segment buffers of the connection */
+  int poolBufferSize;         /* bytes per buffer */
+  int poolHighWater;          /* most buffers in use at once */
+  unsigned long poolAllocs;   /* buffers handed out */
+  unsigned long poolFailures; /* times there was none left */
+} stp_sender_stats;
+
+extern int stp_log_level;       /* see stp.h */
+
+void stp_config_defaults(stp_sender_config *cfg);
+
+/* Nonblocking */
+int stp_connect(stp_send_ctrl_blk **conn, const stp_sender_config *cfg, char *destination,
+                int destinationPort, int receivePort, long long size, unsigned int transfer,
+                long long offset);
+int stp_fd(stp_send_ctrl_blk *stp_CB);
+int stp_timeout(stp_send_ctrl_blk *stp_CB);
+int stp_process(stp_send_ctrl_blk *stp_CB);
+int stp_write(stp_send_ctrl_blk *stp_CB, const unsigned char *data, int length);
+int stp_write_mapped(stp_send_ctrl_blk *stp_CB, const unsigned char *data, int length);
+int stp_shutdown(stp_send_ctrl_blk *stp_CB);
+void stp_free(stp_send_ctrl_blk *stp_CB);
+void stp_stats(stp_send_ctrl_blk *stp_CB, stp_sender_stats *stats);
+int stp_mss(stp_send_ctrl_blk *stp_CB);
+const char *stp_strerror(int error);
+const char *stp_conn_strerror(stp_send_ctrl_blk *stp_CB);
+
+/* Blocking */
+stp_send_ctrl_blk *stp_open(char *destination, int destinationPort,
+                            int receivePort, long long size);
+stp_send_ctrl_blk *stp_open_stripe(const stp_sender_config *cfg, char *destination,
+                                   int destinationPort, int receivePort, long long size,
+                                   unsigned int transfer, long long offset);
+int stp_send(stp_send_ctrl_blk *stp_CB, unsigned char *data, int length);
+int stp_send_mapped(stp_send_ctrl_blk *stp_CB, unsigned char *data, int length);
+int stp_close(stp_send_ctrl_blk *stp_CB);
+int stp_close_stats(stp_send_ctrl_blk *stp_CB, stp_sender_stats *stats);
+
+#endif
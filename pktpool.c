@@ -0,0 +1,97 @@
+/*
+ * Packet buffer pool for STP.
+ *
+ * Every connection preallocates the pktbufs it can ever need in one
+ * cache-line-aligned slab and hands them out from a free list, so
+ * buffering a packet never calls malloc()/free(). Each buffer only
+ * has room for one MSS of payload. When the pool is empty the caller
+ * has to treat that as a full window.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "stp.h"
+
+/*
+ * Carve "capacity" buffers of "dataSize" payload bytes each out of a
+ * new slab. Returns 0 on success, -1 if out of memory.
+ */
+int stp_pool_init(stp_pktpool *pool, int capacity, int dataSize)
+{
+  void *slab;
+  int i;
+
+  pool->stride = offsetof(pktbuf, data) + dataSize;
+  pool->stride = (pool->stride + STP_CACHE_LINE - 1) & ~(STP_CACHE_LINE - 1);
+
+  if (posix_memalign(&slab, STP_CACHE_LINE, (size_t)pool->stride * capacity) != 0)
+    return -1;
+
+  pool->slab = (char *)slab;
+  pool->capacity = capacity;
+  pool->dataSize = dataSize;
+  pool->freeList = NULL;
+  for (i = capacity - 1; i >= 0; i--)
+    {
+      pktbuf *p = (pktbuf *)(pool->slab + (size_t)i * pool->stride);
+      p->next = pool->freeList;
+      pool->freeList = p;
+    }
+
+  pool->inUse = 0;
+  pool->highWater = 0;
+  pool->allocs = 0;
+  pool->failures = 0;
+  return 0;
+}
+
+void stp_pool_destroy(stp_pktpool *pool)
+{
+  free(pool->slab);
+  pool->slab = NULL;
+  pool->freeList = NULL;
+}
+
+/*
+ * Take a buffer from the pool, or NULL if all of them are in use.
+ */
+pktbuf *stp_pool_get(stp_pktpool *pool)
+{
+  pktbuf *p = pool->freeList;
+
+  if (p == NULL)
+    {
+      pool->failures++;
+      return NULL;
+    }
+
+  pool->freeList = p->next;
+  p->next = NULL;
+  pool->allocs++;
+  if (++pool->inUse > pool->highWater)
+    pool->highWater = pool->inUse;
+  return p;
+}
+
+void stp_pool_put(stp_pktpool *pool, pktbuf *p)
+{
+  p->next = pool->freeList;
+  pool->freeList = p;
+  pool->inUse--;
+}
+
+int stp_pool_empty(stp_pktpool *pool)
+{
+  return pool->freeList == NULL;
+}
+
+/*
+ * Print the pool counters, prefixed with "name".
+ */
+void stp_pool_stats(stp_pktpool *pool, const char *name)
+{
+  printf("%s pool: %d buffers of %d bytes, high water %d, %lu allocs, %lu failures\n",
+         name, pool->capacity, pool->stride, pool->highWater,
+         pool->allocs, pool->failures);
+}
@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/file.h>
@@ -23,6 +24,10 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 #include "stp.h"
 
@@ -32,6 +37,18 @@
 #define RAND_MAX 2147483647   /* = 2^31-1 */
 
 int ReceiverMaxWin = 5000;        /* Maximum window size */
+int SackEnabled = 1;              /* report out-of-order data in ACKs */
+int ReceiverMaxMtu = STP_DEFAULT_MAX_MTU; /* largest packet we agree to */
+int ReceiverMaxVersion = STP_VERSION_2;   /* newest wire version we speak */
+int ReceiverCrc32c = 1;           /* agree to CRC32C checksums if offered */
+int ReceiverDirect = 0;           /* place data straight into the file when its size is known */
+int AckEvery = 2;                 /* ACK at least every this many in-order segments */
+int AckDelayMs = 10;              /* longest an in-order segment waits for its ACK */
+int WriterSize = STP_WRITER_SIZE; /* bytes of output the writer thread may lag behind */
+int ReceiverServe = 0;            /* accept any number of senders on one port */
+int ServerIdleMs = 30000;         /* serving: drop a connection silent for this long */
+int ServerMaxConns = 1024;        /* serving: most connections at once */
+int ReceiverShards = 1;           /* serving: threads, each with its own socket; 0 is one per CPU */
 
 double PacketLossProbability              = 0.0; /* packet loss probability */
 double AckLossProbability                 = 0.0; /* ACK loss probability */
@@ -41,8 +58,17 @@ double CorruptedACKProbability            = 0.0; /* probability of corruption on
 
 /* See the implementation of stp_recv_ctrl_blk in stp.h */
 
-/* Global file descriptor for the output file. */
-int outFile = -1;
+/* How often to look at the window while the writer holds it shut, ms */
+#define WINDOW_POLL_MS 2
+
+/* How long a finished connection stays to ACK a retransmitted FIN, ms */
+#define TIME_WAIT_MS 2000
+
+/* How often a serving receiver looks for connections to evict, ms */
+#define SWEEP_MS 1000
+
+/* Most CPUs the shards are spread over */
+#define MAX_CPUS 1024
 
 /*******************************************************************/
 /* Since the protocol STP is event driven, we define             */
@@ -59,10 +85,28 @@ typedef struct stp_event_t {
 
 //**************************************************************
 
+/*
+ * The simulation's random numbers. Every thread of a sharded receiver
+ * draws from a generator of its own, so they share no state.
+ */
+static __thread unsigned short randState[3];
+
+static void stp_rand_seed(long seed)
+{
+  randState[0] = 0x330E;   /* as srand48() does */
+  randState[1] = (unsigned short) seed;
+  randState[2] = (unsigned short) (seed >> 16);
+}
+
+static long stp_rand(void)
+{
+  return nrand48(randState);
+}
+
 /*  Return 1 with probability p, and 0 otherwise */
 int event_happens(double p) {
   
-  long val = lrand48();
+  long val = stp_rand();
   
   if (val < RAND_MAX * p)
     return 1;
@@ -71,12 +115,14 @@ int event_happens(double p) {
 }
 
 /*
- * Open a UDP connection.
+ * Open a UDP socket bound to local_port, on which packets from any
+ * sender arrive. With reuseport, several sockets can be bound to the
+ * same port and the kernel spreads the senders over them, hashing on
+ * their address so that each sender always lands on the same one.
  */
-int udp_open(char *remote_IP_str, int remote_port, int local_port)
+int udp_bind(int local_port, int reuseport)
 {
   int      fd;
-  uint32_t dst;
   struct   sockaddr_in sin;
   
   fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -86,8 +132,24 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port)
       return -1;
     }
   
+#if defined(SO_REUSEPORT)
+  if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)) < 0)
+    {
+      perror("SO_REUSEPORT");
+      close(fd);
+      return -1;
+    }
+#else
+  if (reuseport)
+    {
+      fprintf(stderr, "SO_REUSEPORT is not supported here\n");
+      close(fd);
+      return -1;
+    }
+#endif
+  
   /* Bind the local socket to listen at the local_port. */
-  printf ("Binding locally to port %d\n", local_port);
+  stp_log(STP_LOG_INFO, "Binding locally to port %d\n", local_port);
   memset((char *)&sin, 0, sizeof(sin));
   sin.sin_family = AF_INET;
   sin.sin_port = htons(local_port);
@@ -95,18 +157,34 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port)
   if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) 
     {
       perror("Bind failed");
+      close(fd);
       return (-2);
     }
   
+  return fd;
+}
+
+/*
+ * Open a UDP connection.
+ */
+int udp_open(char *remote_IP_str, int remote_port, int local_port)
+{
+  int      fd;
+  uint32_t dst;
+  struct   sockaddr_in sin;
+  
+  if ((fd = udp_bind(local_port, 0)) < 0)
+    return fd;
+  
   /* Connect, i.e. prepare to accept UDP packets from <remote_host, remote_port>.  */
   /* Listen() and accept() are not necessary with UDP connection setup.            */ 
   dst = hostname_to_ipaddr(remote_IP_str);
   
   if (!dst) {
-    printf("Invalid sending host name: %s\n", remote_IP_str);
+    stp_log(STP_LOG_ERROR, "Invalid sending host name: %s\n", remote_IP_str);
     return -4;
   }
-  printf ("Configuring  UDP \"connection\" to <%u.%u.%u.%u, port %d>\n", 
+  stp_log(STP_LOG_INFO, "Configuring  UDP \"connection\" to <%u.%u.%u.%u, port %d>\n", 
           (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF, 
           (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF, remote_port);
   
@@ -119,7 +197,7 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port)
       perror("connect");
       return(-1);
       }
-  printf ("UDP \"connection\" to <%u.%u.%u.%u port %d> configured\n", 
+  stp_log(STP_LOG_INFO, "UDP \"connection\" to <%u.%u.%u.%u port %d> configured\n", 
           (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF, 
           (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF , remote_port);
   
@@ -127,33 +205,253 @@ int udp_open(char *remote_IP_str, int remote_port, int local_port)
 }
 
 
+/*
+ * Send a packet of the given type, with options, in the wire format
+ * the connection negotiated. Our window is scaled down as promised in
+ * the SYN-ACK.
+ */
+static void stp_send_ctrl(stp_recv_ctrl_blk *stp_CB, int type, unsigned int seqno,
+                          char *opts, int optsLen, int corrupted)
+{
+  stp_pkt p;
+  
+  memset(&p, 0, sizeof(p));
+  p.version = stp_CB->version;
+  p.cksum = stp_CB->cksum;
+  p.type = type;
+  p.window = stp_CB->rwnd >> stp_CB->wscale;
+  p.seqno = seqno;
+  p.tsecr = stp_CB->tsRecent;
+  p.opts = opts;
+  p.optsLen = optsLen;
+  if (stp_sendpkt_to(stp_CB->fd, &p, corrupted, &stp_CB->peer) < 0)
+    stp_log(STP_LOG_WARN, "write: %s\n", strerror(errno));
+}
+
+/*
+ * Send a RESET to the sender of this connection.
+ */
+static void stp_send_reset(stp_recv_ctrl_blk *stp_CB, int corrupted)
+{
+  stp_pkt p;
+  
+  memset(&p, 0, sizeof(p));
+  p.version = STP_VERSION_1;
+  p.type = STP_RESET;
+  if (stp_sendpkt_to(stp_CB->fd, &p, corrupted, &stp_CB->peer) < 0)
+    stp_log(STP_LOG_WARN, "write: %s\n", strerror(errno));
+}
+
+/*
+ * Protocol error: reset the connection. Unlike reset(), this does not
+ * exit, as the receiver may be serving other senders; the caller
+ * gives up on this one.
+ */
+static void stp_reset(stp_recv_ctrl_blk *stp_CB)
+{
+  fprintf(stderr, "protocol error encountered... resetting connection\n");
+  stp_send_reset(stp_CB, 0);
+}
+
 /*
  * Send an STP ack back to the source.  The stp_CB tells
  * us what frame we expect, so we ack that sequence number.
+ * Any out-of-order data we hold is listed as SACK blocks.
  */
 void stp_send_ack(stp_recv_ctrl_blk *stp_CB)
 {
   if (!event_happens(AckLossProbability) || stp_CB->state == STP_LISTEN) {
     /* Won't drop packets when we are sending out the ACK to
        acknowledge the SYN */
-    sendpkt2(stp_CB->fd, STP_ACK, stp_CB->rwnd, stp_CB->NBE, 0, 0,
-             event_happens(CorruptedACKProbability));
+    stp_sack_block blocks[STP_MAX_SACK_BLOCKS];
+    char opts[STP_MAX_OPTIONS];
+    int nblocks = 0, optsLen = 0;
+    
+    if (SackEnabled)
+      nblocks = stp_CB->direct ? get_map_sack_blocks(stp_CB, blocks, STP_MAX_SACK_BLOCKS) :
+        get_sack_blocks(stp_CB, blocks, STP_MAX_SACK_BLOCKS);
+    if (nblocks > 0)
+      optsLen = stp_put_sack(opts, 0, stp_CB->version, blocks, nblocks);
+    
+    stp_send_ctrl(stp_CB, STP_ACK, stp_CB->NBE, opts, optsLen,
+                  event_happens(CorruptedACKProbability));
   } else {
-    printf("ACK (%u) dropped\n", stp_CB->NBE); 
+    stp_log(STP_LOG_DEBUG, "ACK (%u) dropped\n", stp_CB->NBE); 
   }
+  
+  /* Whatever was waiting for an ACK has had it now */
+  stp_CB->ackNow = 0;
+  stp_CB->unackedSegs = 0;
+  stp_CB->lastAdvertised = stp_CB->rwnd;
+  stp_timer_cancel(&stp_CB->loop->timers, &stp_CB->ackTimer);
 }
 
+/*
+ * The delayed ACK timer expired before AckEvery segments arrived.
+ */
+static void stp_ack_timeout(stp_timer *t, void *arg)
+{
+  stp_send_ack((stp_recv_ctrl_blk *) arg);
+}
+
+/*
+ * Work out the window to advertise: what is left of maxWin once the
+ * out-of-order data is accounted for, and never more than the writer
+ * thread has room for, so a disk that falls behind slows the sender
+ * down instead of stalling the network thread. While the writer is
+ * what limits the window, a timer watches it open up again.
+ */
+static void stp_update_window(stp_recv_ctrl_blk *stp_CB)
+{
+  unsigned int held = minus(stp_CB->LBReceived, stp_CB->LBRead);
+  unsigned int win = stp_CB->maxWin;
+  
+  if (!stp_CB->direct && stp_writer_room(stp_CB->writer) < win)
+    {
+      win = stp_writer_room(stp_CB->writer);
+      if (!stp_timer_pending(&stp_CB->windowTimer))
+        stp_timer_arm(&stp_CB->loop->timers, &stp_CB->windowTimer,
+                      stp_now_ms() + WINDOW_POLL_MS);
+    }
+  stp_CB->rwnd = win > held ? win - held : 0;
+}
+
+/*
+ * ACK policy, applied once all the packets of a recvmmsg() drain have
+ * been processed, so that one ACK covers them all. The ACK goes out
+ * now if something needs the sender's attention at once (out-of-order
+ * data, a duplicate, a filled gap, a window that opened up) or if
+ * AckEvery in-order segments are waiting for it; otherwise the delay
+ * timer sends it within AckDelayMs.
+ */
+static void stp_ack_policy(stp_recv_ctrl_blk *stp_CB)
+{
+  /* Before the SYN there is nothing to acknowledge */
+  if (stp_CB->state != STP_ESTABLISHED)
+    return;
+  
+  if (stp_CB->rwnd >= stp_CB->lastAdvertised + 2 * stp_CB->mss)
+    stp_CB->ackNow = 1;
+  
+  if (stp_CB->ackNow || stp_CB->unackedSegs >= AckEvery)
+    stp_send_ack(stp_CB);
+  else if (stp_CB->unackedSegs > 0 && !stp_timer_pending(&stp_CB->ackTimer))
+    stp_timer_arm(&stp_CB->loop->timers, &stp_CB->ackTimer, stp_now_ms() + AckDelayMs);
+}
+
+/*
+ * The writer was holding the window down; send a window update once
+ * it has opened far enough (see stp_ack_policy()).
+ */
+static void stp_window_timeout(stp_timer *t, void *arg)
+{
+  stp_recv_ctrl_blk *stp_CB = (stp_recv_ctrl_blk *) arg;
+  
+  stp_update_window(stp_CB);
+  stp_ack_policy(stp_CB);
+}
+
+
+/*
+ * Acknowledge the SYN, telling the sender which MSS we agreed to and,
+ * for v2, our window scale and checksum. The SYN-ACK goes out in the negotiated
+ * version, which is how the sender learns it. It is never dropped or
+ * corrupted by the simulation.
+ */
+void stp_send_synack(stp_recv_ctrl_blk *stp_CB)
+{
+  char opts[STP_MAX_OPTIONS];
+  unsigned short mss = htons(stp_CB->mss);
+  unsigned char version = stp_CB->version, wscale = stp_CB->wscale, cksum = stp_CB->cksum;
+  int optsLen = stp_put_option(opts, 0, STP_OPT_MSS, &mss, sizeof(mss));
+  
+  if (stp_CB->version >= STP_VERSION_2) {
+    optsLen = stp_put_option(opts, optsLen, STP_OPT_VERSION, &version, sizeof(version));
+    optsLen = stp_put_option(opts, optsLen, STP_OPT_WSCALE, &wscale, sizeof(wscale));
+    optsLen = stp_put_option(opts, optsLen, STP_OPT_CKSUM, &cksum, sizeof(cksum));
+  }
+  
+  stp_send_ctrl(stp_CB, STP_ACK, plus(stp_CB->ISN, 1), opts, optsLen, 0);
+}
+
+/*
+ * Settle the connection parameters from the SYN's options. The wire
+ * version is the newest both sides speak; a v1 peer limits the window
+ * to what 16-bit sequence numbers can tell apart, a v2 peer gets a
+ * window scale large enough to advertise all of it, and CRC32C if it
+ * asks for it and we have not been told to stick to the sum. The MSS is the
+ * sender's offer, at least STP_MIN_MSS (all the segment arithmetic
+ * divides by it), bounded by our own maximum packet size and by the
+ * receive window, which must hold at least one full segment.
+ */
+void stp_negotiate(stp_recv_ctrl_blk *stp_CB, char *opts, int optsLen)
+{
+  unsigned short offer;
+  unsigned char version, cksum;
+  unsigned int size[2], stripe[3];
+  int mss = STP_MSS;
+  
+  stp_CB->version = STP_VERSION_1;
+  if (stp_get_option(opts, optsLen, STP_OPT_VERSION, &version, sizeof(version)) == sizeof(version) &&
+      version >= STP_VERSION_2 && ReceiverMaxVersion >= STP_VERSION_2)
+    stp_CB->version = STP_VERSION_2;
+  
+  stp_CB->cksum = STP_CKSUM_SUM;
+  if (stp_CB->version >= STP_VERSION_2 && ReceiverCrc32c &&
+      stp_get_option(opts, optsLen, STP_OPT_CKSUM, &cksum, sizeof(cksum)) == sizeof(cksum) &&
+      cksum == STP_CKSUM_CRC32C)
+    stp_CB->cksum = STP_CKSUM_CRC32C;
+  
+  stp_CB->maxWin = ReceiverMaxWin;
+  stp_CB->wscale = 0;
+  if (stp_CB->version < STP_VERSION_2)
+    {
+      if (stp_CB->maxWin > STP_MAX_WIN_V1)
+        stp_CB->maxWin = STP_MAX_WIN_V1;
+    }
+  else
+    while ((stp_CB->maxWin >> stp_CB->wscale) > 0xffff)
+      stp_CB->wscale++;
+  
+  if (stp_get_option(opts, optsLen, STP_OPT_MSS, &offer, sizeof(offer)) == sizeof(offer))
+    mss = ntohs(offer);
+  
+  if (mss < STP_MIN_MSS)
+    mss = STP_MIN_MSS;
+  if (mss > ReceiverMaxMtu - STP_HEADER_LEN(stp_CB->version))
+    mss = ReceiverMaxMtu - STP_HEADER_LEN(stp_CB->version);
+  if (mss > stp_CB->maxWin)
+    mss = stp_CB->maxWin;
+  stp_CB->mss = mss;
+  
+  stp_CB->fileSize = -1;
+  if (stp_get_option(opts, optsLen, STP_OPT_SIZE, size, sizeof(size)) == sizeof(size))
+    stp_CB->fileSize = (long long) ntohl(size[0]) << 32 | ntohl(size[1]);
+  
+  stp_CB->fileBase = -1;
+  if (stp_get_option(opts, optsLen, STP_OPT_STRIPE, stripe, sizeof(stripe)) == sizeof(stripe))
+    {
+      stp_CB->transfer = ntohl(stripe[0]);
+      stp_CB->fileBase = (long long) ntohl(stripe[1]) << 32 | ntohl(stripe[2]);
+    }
+}
 
 /*
  * Routine that simulates handing off a message to the application.
- * (We'll just write it to the output file directly.)
+ * (We hand it to the writer thread, which puts it in the output file.)
  * STP ensures that messages are delivered in sequence.
+ * Returns 0, or -1 if the output file could not be written.
  */
-void stp_consume(char *pkt, int len)
+int stp_consume(stp_recv_ctrl_blk *stp_CB, char *pkt, int len)
 {
   //char b[1000];
-  write(outFile, pkt, len);
-  printf("consume: %d bytes\n", len);
+  if (stp_writer_put(stp_CB->writer, pkt, len) < 0)
+    {
+      perror("OutputFile could not be written");
+      return -1;
+    }
+  stp_log(STP_LOG_DEBUG, "consume: %d bytes\n", len);
+  return 0;
   
   // Debugging code, if needed
   // strncpy(b, pkt, len);
@@ -161,39 +459,163 @@ void stp_consume(char *pkt, int len)
   /*printf("Contents: <%s>\n", b);*/
 }
 
-int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *pe)
+/*
+ * Name of the connection's output file: "OutputFile" or, when serving
+ * many senders, "OutputFile.<address>.<port>" of the sender. All the
+ * stripes of a file that comes over several connections go to
+ * "OutputFile.<address>.<transfer>" instead.
+ */
+static void stp_output_name(stp_recv_ctrl_blk *stp_CB, char *name, int size)
 {
+  if (ReceiverServe && stp_CB->fileBase >= 0)
+    snprintf(name, size, "OutputFile.%s.%08x", inet_ntoa(stp_CB->peer.sin_addr),
+             stp_CB->transfer);
+  else if (ReceiverServe)
+    snprintf(name, size, "OutputFile.%s.%d", inet_ntoa(stp_CB->peer.sin_addr),
+             ntohs(stp_CB->peer.sin_port));
+  else
+    snprintf(name, size, "OutputFile");
+}
+
+/*
+ * Once the SYN has been negotiated, create the output file and get
+ * ready to deliver into it. With the size of the transfer known, data
+ * can go straight to its place in the file. Otherwise we need the
+ * reorder window, which is sized in segments, so it waits for the
+ * MSS, and a writer thread. A stripe is always placed directly, at
+ * its offset, and must not truncate the file the other stripes are
+ * writing. Returns 0, or -1 if any of that failed.
+ */
+static int stp_open_output(stp_recv_ctrl_blk *stp_CB)
+{
+  int striped = stp_CB->fileBase >= 0;
+  int mapped = !striped && ReceiverDirect && stp_CB->fileSize >= 0;
+  char name[64];
+  void *writer;
   
-  unsigned short seqno;
-  stp_header *srh = (stp_header *)pe->pkt;
-  int type;
-  unsigned short int LBA; /* Last byte accepted */
+  if (striped && stp_CB->fileSize < 0)
+    {
+      stp_log(STP_LOG_ERROR, "A stripe without a size.\n");
+      return -1;
+    }
   
-  /* If the length is too short for a header, that's an error */
-  if (pe->len < sizeof(*srh)) {
-    printf("Size too short.\n");
-    reset(stp_CB->fd); 
+  stp_output_name(stp_CB, name, sizeof(name));
+  /* A shared mapping needs the file open for reading as well */
+  stp_CB->outFd = open(name, (mapped ? O_RDWR : O_WRONLY) | O_CREAT | (striped ? 0 : O_TRUNC),
+                       0644);
+  if (stp_CB->outFd < 0) 
+    {
+      perror("OutputFile could not be created");
+      return -1;
+    }
+  
+  if (striped)
+    {
+      if (init_output_map(stp_CB, stp_CB->outFd, stp_CB->fileSize) < 0)
+        {
+          perror("OutputFile could not be allocated");
+          return -1;
+        }
+      stp_log(STP_LOG_INFO, "placing %lld bytes at %lld in %s\n", stp_CB->fileSize,
+              stp_CB->fileBase, name);
+      return 0;
+    }
+  if (mapped)
+    {
+      if (init_output_map(stp_CB, stp_CB->outFd, stp_CB->fileSize) < 0)
+        {
+          perror("OutputFile could not be allocated");
+          return -1;
+        }
+      stp_log(STP_LOG_INFO, "placing %lld bytes directly in %s%s\n", stp_CB->fileSize, name,
+              stp_CB->outMap == NULL ? " with pwrite()" : "");
+      return 0;
+    }
+  
+  if (init_packet_queue(stp_CB, stp_CB->maxWin / stp_CB->mss + 2) < 0)
     return -1;
-  }
+  if (posix_memalign(&writer, STP_CACHE_LINE, sizeof(stp_writer)) != 0)
+    return -1;
+  if (stp_writer_init((stp_writer *) writer, stp_CB->outFd, WriterSize) < 0)
+    {
+      fprintf(stderr, "Could not start the output writer\n");
+      free(writer);
+      return -1;
+    }
+  stp_CB->writer = (stp_writer *) writer;
+  return 0;
+}
+
+/*
+ * Everything delivered goes to the disk and the output file is
+ * closed. Returns 0, or -1 (with errno set) if some of the data could
+ * not be written.
+ */
+static int stp_close_output(stp_recv_ctrl_blk *stp_CB)
+{
+  int ret = 0;
   
-  /* Checks if the sum of bytes is correct */
-  if (srh->checksum != checksum(srh, pe->len - sizeof(stp_header))) {
-    printf("Sum of bytes doesn't match. Ignoring packet.\n");
-    // Packet is ignored.
-    return 0;
-  }
+  if (stp_CB->writer != NULL)
+    {
+      /* Nothing left to watch the writer's room for */
+      stp_timer_cancel(&stp_CB->loop->timers, &stp_CB->windowTimer);
+      if (stp_writer_close(stp_CB->writer) < 0)
+        ret = -1;
+      stp_writer_stats(stp_CB->writer);
+      free(stp_CB->writer);
+      stp_CB->writer = NULL;
+    }
+  if (stp_CB->placed != NULL && close_output_map(stp_CB) < 0)
+    ret = -1;
+  if (stp_CB->outFd >= 0 && close(stp_CB->outFd) < 0)
+    ret = -1;
+  stp_CB->outFd = -1;
+  return ret;
+}
+
+int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *pe)
+{
+  
+  unsigned int seqno;
+  stp_pkt p;
+  int type;
+  unsigned int LBA; /* Last byte accepted */
   
   /* Strip out the fields of the header from the packet */
-  type = ntohs(srh->type);
-  seqno = ntohs(srh->seqno);
+  switch (stp_decode(&p, pe->pkt, pe->len, stp_CB->NBE))
+    {
+    case STP_TRUNCATED:
+      /* If the length is too short for a header, that's an error */
+      stp_log(STP_LOG_WARN, "Size too short.\n");
+      stp_reset(stp_CB); 
+      return -1;
+      
+    case STP_CORRUPTED:
+      /* The sum of bytes is not correct */
+      stp_log(STP_LOG_WARN, "Sum of bytes doesn't match. Ignoring packet.\n");
+      // Packet is ignored.
+      return 0;
+    }
+  
+  type = p.type;
+  seqno = p.seqno;
+  
+  /*
+   * The next ACK echoes the timestamp of the oldest packet it answers
+   * (RFC 7323): only a packet that arrives while no ACK is pending
+   * sets it. Echoing a later one would leave the time the ACK was
+   * delayed out of the sender's RTT samples.
+   */
+  if (stp_CB->unackedSegs == 0 && !stp_CB->ackNow)
+    stp_CB->tsRecent = p.tsval;
   
   switch (stp_CB->state) 
     {
     case STP_LISTEN: 
       if (type != STP_SYN) 
         {
-          printf("Not SYN.\n");
-          reset(stp_CB->fd); 
+          stp_log(STP_LOG_ERROR, "Not SYN.\n");
+          stp_reset(stp_CB); 
           return -1;
         }
       
@@ -201,8 +623,30 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
       stp_CB->LBRead = seqno;
       stp_CB->LBReceived = seqno;
       stp_CB->NBE = plus(seqno, 1);
+      stp_negotiate(stp_CB, p.opts, p.optsLen);
+      stp_log(STP_LOG_INFO, "version %d MSS %d window %d scale %d checksum %s\n", stp_CB->version,
+             stp_CB->mss, stp_CB->maxWin, stp_CB->wscale,
+             stp_CB->cksum == STP_CKSUM_CRC32C ? stp_crc32c_impl() : "sum");
+      
+      /* A full window has to fit in the socket, or bursts are dropped */
+      {
+        int rcvbuf, want = 2 * stp_CB->maxWin;
+        socklen_t optlen = sizeof(rcvbuf);
+        
+        if (getsockopt(stp_CB->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == 0 &&
+            rcvbuf < want &&
+            setsockopt(stp_CB->fd, SOL_SOCKET, SO_RCVBUF, &want, sizeof(want)) < 0)
+          perror("SO_RCVBUF");
+      }
+      
+      if (stp_open_output(stp_CB) < 0)
+        {
+          stp_reset(stp_CB);
+          return -1;
+        }
+      stp_update_window(stp_CB);
       stp_CB->state = STP_ESTABLISHED;
-      stp_send_ack(stp_CB);
+      stp_send_synack(stp_CB);
       return 0;
       
       break; 
@@ -210,13 +654,13 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
     case STP_TIME_WAIT: 
       if (type != STP_FIN) 
         {
-          reset(stp_CB->fd); 
+          stp_reset(stp_CB); 
           return -1;
         }
       /* if the seqno of the FIN is wrong, reset the connection */
       if (seqno != stp_CB->NBE) 
         {
-          reset(stp_CB->fd);
+          stp_reset(stp_CB);
           return -1;
         }
       
@@ -233,7 +677,7 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
         {
         case STP_RESET: 
           fprintf (stderr, "Reset received from sender -- closing\n");
-          sendpkt2(stp_CB->fd, STP_RESET, 0, 0, 0, 0, event_happens(CorruptedACKProbability));
+          stp_send_reset(stp_CB, event_happens(CorruptedACKProbability));
           return -1;
           break; 
           
@@ -241,8 +685,7 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
           if(seqno == stp_CB->ISN)
             {
               /* this is a retransmission of the first SYN, acknowledge */
-              sendpkt2(stp_CB->fd, STP_ACK, stp_CB->rwnd, plus(stp_CB->ISN, 1),
-                       0, 0, event_happens(CorruptedACKProbability));
+              stp_send_synack(stp_CB);
               return 0;
             }
           break; 
@@ -252,8 +695,8 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
           /* Otherwise the FIN is occuring prior to our receipt of all data. */
           if (seqno != stp_CB->NBE) 
             {
-              printf("FIN seq not equal to NBE (%u != %u).\n", seqno, stp_CB->NBE);
-              reset(stp_CB->fd);
+              stp_log(STP_LOG_ERROR, "FIN seq not equal to NBE (%u != %u).\n", seqno, stp_CB->NBE);
+              stp_reset(stp_CB);
               return -1;
             }
           stp_CB->state = STP_TIME_WAIT;
@@ -267,30 +710,78 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
           stp_send_ack(stp_CB);
           stp_CB->NBE = minus(stp_CB->NBE, 1); 
           
+          if (!stp_CB->direct)
+            stp_pool_stats(&stp_CB->recvPool, "receive");
+          if (stp_close_output(stp_CB) < 0)
+            {
+              perror("OutputFile could not be written");
+              return -1;
+            }
           return 1;  
-          /* Indicate that the file transfer is complete. Note that we
-           * do not go into the state TIME_WAIT in this implementation
-           * of the receiver.
+          /* Indicate that the file transfer is complete. A receiver
+           * serving many senders keeps the connection in TIME_WAIT for
+           * a while, in case the FIN-ACK is lost; otherwise we are done.
            */
           break; 
           
         case STP_DATA: 
           
-          LBA = plus(stp_CB->LBRead, ReceiverMaxWin);
+          if (p.len > stp_CB->mss)
+            {
+              stp_log(STP_LOG_WARN, "Packet larger than the MSS. Ignoring packet.\n");
+              return 0;
+            }
+          
+          LBA = plus(stp_CB->LBRead, stp_CB->maxWin);
           
           if (greater(stp_CB->NBE, seqno)) 
             {
               /* retransmitted packet that we've already received do
-               * nothing except send an ACK (at function bottom)
+               * nothing except send an ACK, straight away: the
+               * sender is probably missing one
                */
+              stp_CB->ackNow = 1;
             }
           else if(greater(seqno, LBA))
             {
-              printf("Packet seqno too large to fit in receive window.\n");
-              reset(stp_CB->fd);
+              stp_log(STP_LOG_ERROR, "Packet seqno too large to fit in receive window.\n");
+              stp_reset(stp_CB);
               return -1;
             } 
           
+          /*
+           * With the size known, new data goes straight to its place
+           * in the file, in order or not (see receiver_map.c).
+           */
+          else if (stp_CB->direct)
+            {
+              unsigned int lastByte = plus(seqno, (p.len -1));
+              int placed = place_packet(stp_CB, seqno, p.len, p.data);
+              
+              if (placed < 0)
+                {
+                  perror("OutputFile could not be written");
+                  stp_reset(stp_CB);
+                  return -1;
+                }
+              if (placed && greater(lastByte, stp_CB->LBReceived))
+                stp_CB->LBReceived = lastByte;
+              
+              if (placed && seqno == stp_CB->NBE)
+                {
+                  stp_CB->NBE = plus(seqno, advance_output_map(stp_CB, p.len));
+                  stp_CB->LBRead = minus(stp_CB->NBE, 1);
+                  
+                  /* Same ACK policy as below */
+                  if (stp_CB->LBRead != lastByte || greater(stp_CB->LBReceived, stp_CB->LBRead))
+                    stp_CB->ackNow = 1;
+                  else
+                    stp_CB->unackedSegs++;
+                }
+              else
+                stp_CB->ackNow = 1;
+            }
+          
           /*
            * New data has arrived. If the ACK arrives in order, hand
            * the data directly to the application (consume it) and see
@@ -303,12 +794,16 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
             {
               
               pktbuf *next;
-              unsigned short lastByte = plus(seqno, (pe->len - sizeof(*srh) -1));
+              unsigned int lastByte = plus(seqno, (p.len -1));
               /* Bug Fixed on 10/29/2003 */
               
               /* packet in order - send to application */
-              stp_consume(pe->pkt + sizeof(*srh), pe->len - sizeof(*srh));
-              seqno = plus(seqno, (pe->len - sizeof(*srh)));
+              if (stp_consume(stp_CB, p.data, p.len) < 0)
+                {
+                  stp_reset(stp_CB);
+                  return -1;
+                }
+              seqno = plus(seqno, p.len);
               
               if (greater(lastByte, stp_CB->LBReceived))
                 stp_CB->LBReceived = lastByte;
@@ -320,14 +815,26 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
               
               while((next = get_packet(stp_CB, seqno)) != NULL) 
                 {
-                  printf("Batch reading!!\n");
+                  stp_log(STP_LOG_DEBUG, "Batch reading!!\n");
                   seqno = plus(seqno,next->len);
-                  stp_consume(next->data, next->len);
-                  free_packet(next);
+                  if (stp_consume(stp_CB, next->data, next->len) < 0)
+                    {
+                      stp_reset(stp_CB);
+                      return -1;
+                    }
+                  free_packet(stp_CB, next);
                 }
               
               stp_CB->NBE = seqno;
               stp_CB->LBRead = minus(seqno,1); /* Bug Fixed on 10/29/2003 */
+              advance_packet_queue(stp_CB, seqno);
+              
+              /* Filling a gap, or still holding data beyond one, is news
+               * for the sender; plain in-order data can wait a little */
+              if (stp_CB->LBRead != lastByte || stp_CB->recvQueueCount > 0)
+                stp_CB->ackNow = 1;
+              else
+                stp_CB->unackedSegs++;
               
             } 
           else 
@@ -336,38 +843,39 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
                * the data and record the seqno to validate the buffer
                */
               
-              unsigned short lastByte = plus(seqno, (pe->len - sizeof(*srh) -1));
+              unsigned int lastByte = plus(seqno, (p.len -1));
               /* Bug Fixed on 10/29/2003 */
               
-              add_packet(stp_CB, seqno, pe->len - sizeof(*srh), pe->pkt + sizeof(*srh));
-              
-              if (greater(lastByte, stp_CB->LBReceived))
+              if (add_packet(stp_CB, seqno, p.len, p.data) &&
+                  greater(lastByte, stp_CB->LBReceived))
                 stp_CB->LBReceived = lastByte;
               
+              /* Out of order: the duplicate ACK tells the sender at once */
+              stp_CB->ackNow = 1;
+              
             }
           
-          if (minus(stp_CB->LBReceived, stp_CB->LBRead) > ReceiverMaxWin)
+          if (minus(stp_CB->LBReceived, stp_CB->LBRead) > stp_CB->maxWin)
             {
-              printf("Not in feasible window.\n");
+              stp_log(STP_LOG_ERROR, "Not in feasible window.\n");
               
-              reset(stp_CB->fd);
+              stp_reset(stp_CB);
               return -1;
             }
           
           
-          stp_CB->rwnd = ReceiverMaxWin - minus(stp_CB->LBReceived, stp_CB->LBRead);
+          stp_update_window(stp_CB);
           
-          printf("rwnd adjusted: (%u)\n", stp_CB->rwnd);
+          stp_log(STP_LOG_DEBUG, "rwnd adjusted: (%u)\n", stp_CB->rwnd);
           
-          /* Always send an ACK back to the sender. */
-          stp_send_ack(stp_CB);
+          /* The ACK policy is applied once the batch is processed. */
           return 0;
           break; 
           
         default: 
           /* Invalid packet received */
-          printf("Invalid packet.\n");
-          reset(stp_CB->fd); 
+          stp_log(STP_LOG_ERROR, "Invalid packet.\n");
+          stp_reset(stp_CB); 
           return -1;
           
         } /*end of switch(type) in ESTABLISHED state*/
@@ -379,132 +887,664 @@ int stp_receive_state_transition_machine(stp_recv_ctrl_blk *stp_CB, stp_event *p
 } /* end of stp_receive_state_transition_machine */
 
 /*
- * Run the receiver polling loop: allocate and initialize the
- * stp_recv_ctrl_blk then enter an infinite loop to process incoming
- * packets.
+ * A receiver on an event loop: its socket, the batch packets are read
+ * into, its connections and the packet the misbehaviour simulation
+ * holds back. Without ReceiverServe there is only ever one connection.
  */
-int stp_receiver_run(char *dst, int sport, int rport)
-{
-  stp_recv_ctrl_blk *stp_CB = (stp_recv_ctrl_blk *) malloc(sizeof(*stp_CB));
-  
-  /* Variables used to simulate out-of-order arrivals */
-  int  delay_pkt_set = 0;
+typedef struct {
+  int fd;
+  stp_loop *loop;
+  stp_batch batch;
+  stp_conn_table conns;
+  stp_timer sweepTimer;     /* evicts idle and finished connections */
+  stp_recv_ctrl_blk *touched[STP_BATCH_MAX]; /* connections the current batch is for */
+  int  ntouched;
+  int  delay_pkt_set;       /* Variables used to simulate out-of-order arrivals */
   int  delay_pkt_len;
-  char delay_pkt[STP_MTU];
-  
-  stp_event *pe = (stp_event *)malloc(sizeof(*pe));
+  char *delay_pkt;
+  stp_recv_ctrl_blk *delay_conn; /* connection of the delayed packet */
+  int  done;                /* 1 once the transfer is complete, -1 if it failed */
+  int  shard;               /* which of the ReceiverShards threads runs it */
+  pthread_t thread;
+} stp_receiver;
+
+/*
+ * A new connection in LISTEN, for the sender at "peer". Returns NULL
+ * if out of memory.
+ */
+static stp_recv_ctrl_blk *stp_conn_open(stp_receiver *r, struct sockaddr_in *peer)
+{
+  stp_recv_ctrl_blk *stp_CB = (stp_recv_ctrl_blk *) calloc(1, sizeof(*stp_CB));
   
-  /*
-   * Initialize the receiver's stp_CB block 
-   * and open the underlying UDP/IP communication channel.
-   */
+  if (stp_CB == NULL)
+    return NULL;
   stp_CB->state = STP_LISTEN;
-  if ((stp_CB->fd = udp_open(dst, sport, rport)) < 0) return -1;
+  stp_CB->fd = r->fd;
+  stp_CB->peer = *peer;
+  stp_CB->version = STP_VERSION_1;
+  stp_CB->cksum = STP_CKSUM_SUM;
+  stp_CB->wscale = 0;
+  stp_CB->maxWin = ReceiverMaxWin;
   stp_CB->rwnd = ReceiverMaxWin;
+  stp_CB->mss = STP_MSS;
+  stp_CB->outFd = -1;
+  stp_CB->writer = NULL;
+  stp_CB->direct = 0;
+  stp_CB->fileSize = -1;
+  stp_CB->fileBase = -1;
   stp_CB->LBRead = 0;
   stp_CB->LBReceived = 0;
   stp_CB->NBE = 1;
-  stp_CB->recvQueue = NULL;
+  stp_CB->tsRecent = 0;
   
-  /*
-   * Enter an infinite loop reading packets from the network
-   * and processing them.  The receiver processing loop is
-   * simple because (unlike the sender) we do not need to schedule
-   * timers or handle any asynchronous events.
+  stp_CB->ackNow = 0;
+  stp_CB->unackedSegs = 0;
+  stp_CB->lastAdvertised = ReceiverMaxWin;
+  stp_CB->loop = r->loop;
+  stp_timer_init(&stp_CB->ackTimer, stp_ack_timeout, stp_CB);
+  stp_timer_init(&stp_CB->windowTimer, stp_window_timeout, stp_CB);
+  
+  stp_conn_insert(&r->conns, stp_CB);
+  if (ReceiverServe)
+    stp_log(STP_LOG_INFO, "connection from %s port %d\n", inet_ntoa(peer->sin_addr),
+            ntohs(peer->sin_port));
+  return stp_CB;
+}
+
+/*
+ * Forget a connection: whatever it delivered is flushed to its file,
+ * and the rest is freed.
+ */
+static void stp_conn_close(stp_receiver *r, stp_recv_ctrl_blk *stp_CB)
+{
+  int i;
+  
+  if (stp_close_output(stp_CB) < 0)
+    perror("OutputFile could not be written");
+  stp_timer_cancel(&r->loop->timers, &stp_CB->ackTimer);
+  stp_timer_cancel(&r->loop->timers, &stp_CB->windowTimer);
+  free_packet_queue(stp_CB);
+  stp_conn_remove(&r->conns, stp_CB);
+  
+  for (i = 0; i < r->ntouched; i++)
+    if (r->touched[i] == stp_CB)
+      r->touched[i] = r->touched[--r->ntouched];
+  if (r->delay_conn == stp_CB)
+    r->delay_pkt_set = 0;
+  free(stp_CB);
+}
+
+/*
+ * Hand one packet of a connection to the state machine and deal with
+ * the outcome. A connection that fails is marked CLOSED and freed
+ * once the batch is processed; one that completes stays in TIME_WAIT
+ * if we serve many senders, and ends the receiver otherwise.
+ */
+static void stp_deliver(stp_receiver *r, stp_recv_ctrl_blk *stp_CB, char *pkt, int len)
+{
+  stp_event ev;
+  
+  if (stp_CB->state == STP_CLOSED)
+    return;
+  ev.pkt = pkt;
+  ev.len = len;
+  switch (stp_receive_state_transition_machine(stp_CB, &ev))
+    {
+    case -1:  /* Error */
+      stp_CB->state = STP_CLOSED;
+      if (!ReceiverServe)
+        r->done = -1;
+      else
+        stp_log(STP_LOG_INFO, "transfer from %s port %d failed\n",
+                inet_ntoa(stp_CB->peer.sin_addr), ntohs(stp_CB->peer.sin_port));
+      break;
+    case 1:   /* File transfer complete */ 
+      if (!ReceiverServe)
+        r->done = 1;
+      else
+        stp_log(STP_LOG_INFO, "transfer from %s port %d complete\n",
+                inet_ntoa(stp_CB->peer.sin_addr), ntohs(stp_CB->peer.sin_port));
+      break;
+    }
+}
+
+/*
+ * Pass one packet that arrived on, unless the simulation loses or
+ * delays it.
+ */
+static void stp_receive_packet(stp_receiver *r, stp_recv_ctrl_blk *stp_CB,
+                               unsigned char *pkt, int len)
+{
+  if (event_happens(CorruptedPacketProbability)) {
+    int random_byte = stp_rand() % len, random_bit = stp_rand() % 8;
+    //printf("RECEIVED PACKET CORRUPTED: byte %d from %02x",
+    //random_byte, pkt[random_byte]);
+    stp_log(STP_LOG_DEBUG, "RECEIVED PACKET CORRUPTED\n");
+    pkt[random_byte] ^= (char) (1 << random_bit);
+    //printf(" to %02x\n", pkt[random_byte]);
+  }
+  
+  /* Do the processing associated with a new packet arrival. But,
+   * with probability PLP, we pretend this packet got lost in the
+   * network.
    */
-  while(1)
+  if (event_happens(PacketLossProbability)) 
+    { 
+      stp_log(STP_LOG_DEBUG, "PACKET DROPPED\n");  /* Do nothing */
+    }    
+  else if (!r->delay_pkt_set && event_happens(OutOfOrderPacketArrivalProbability)) 
+    {        
+      stp_log(STP_LOG_DEBUG, "PACKET DELAYED\n");
+      memcpy (r->delay_pkt, pkt, len);
+      r->delay_pkt_len = len; 
+      r->delay_pkt_set = 1;
+      r->delay_conn = stp_CB;
+    }
+  else
+    {
+      /* Process the packets in reverse order and unset delay_pkt_set
+       * bit. The delayed packet is dropped if this one ended its
+       * connection, say a FIN that overtook it. */
+      stp_deliver(r, stp_CB, (char *) pkt, len);
+      if (r->delay_pkt_set)
+        {
+          r->delay_pkt_set = 0;
+          if (r->done == 0 && (r->delay_conn != stp_CB || stp_CB->state == STP_ESTABLISHED))
+            stp_deliver(r, r->delay_conn, r->delay_pkt, r->delay_pkt_len);
+        }
+    }
+}
+
+/*
+ * The connection a packet from "peer" belongs to. A SYN from a sender
+ * we have not heard from, or one whose previous transfer is over,
+ * opens a new connection; so does anything at all while we wait for
+ * our one sender. Returns NULL if the packet is to be ignored.
+ */
+static stp_recv_ctrl_blk *stp_demux(stp_receiver *r, struct sockaddr_in *peer,
+                                    unsigned char *pkt, int len)
+{
+  stp_recv_ctrl_blk *stp_CB = stp_conn_find(&r->conns, peer);
+  int version, type = 0;
+  unsigned int seqno, window;
+  
+  if (stp_CB != NULL && stp_CB->state != STP_TIME_WAIT)
+    return stp_CB;
+  
+  if (len >= (int) sizeof(stp_header))
+    stp_peek(pkt, &version, &type, &seqno, &window);
+  if (stp_CB != NULL)
     {
-      int len;
-      unsigned char pkt[STP_MTU];
+      if (type != STP_SYN)
+        return stp_CB;
+      stp_conn_close(r, stp_CB);   /* the sender has started over */
+    }
+  else if (ReceiverServe && type != STP_SYN)
+    return NULL;
+  
+  if (r->conns.count >= (ReceiverServe ? ServerMaxConns : 1))
+    {
+      stp_log(STP_LOG_WARN, "too many connections, ignoring %s port %d\n",
+              inet_ntoa(peer->sin_addr), ntohs(peer->sin_port));
+      return NULL;
+    }
+  if ((stp_CB = stp_conn_open(r, peer)) == NULL)
+    perror("connection");
+  return stp_CB;
+}
+
+/*
+ * Loop handler of the receiver's socket. Reads the packets that have
+ * arrived, a batch at a time with one recvmmsg(), until the socket is
+ * empty, and hands each to its connection. The data of each batch is
+ * acknowledged with at most one ACK per connection.
+ */
+static void stp_receiver_input(int fd, void *arg)
+{
+  stp_receiver *r = (stp_receiver *) arg;
+  int i, n = 0;
+  
+  while (r->done == 0 && (n = stp_batch_recv(&r->batch, 0)) > 0)
+    {
+      long long now = stp_now_ms();
+      
+      r->ntouched = 0;
+      for (i = 0; i < n && r->done == 0; i++)
+        {
+          int j, len = stp_batch_len(&r->batch, i);
+          unsigned char *pkt = stp_batch_pkt(&r->batch, i);
+          stp_recv_ctrl_blk *stp_CB;
+          
+          if (len <= 0 ||
+              (stp_CB = stp_demux(r, stp_batch_from(&r->batch, i), pkt, len)) == NULL)
+            continue;
+          
+          stp_CB->lastHeard = now;
+          for (j = 0; j < r->ntouched && r->touched[j] != stp_CB; j++)
+            ;
+          if (j == r->ntouched)
+            r->touched[r->ntouched++] = stp_CB;
+          
+          stp_receive_packet(r, stp_CB, pkt, len);
+        }
       
-      /* Block until a new packet arrives */
-      while ((len = readpkt(stp_CB->fd, pkt, sizeof(pkt))) <= 0)  /* Bug fixed in v1.2 */
-        ;   /* Busy wait */
+      /* One ACK covers all the data in the batch */
+      while (r->done == 0 && r->ntouched > 0)
+        {
+          stp_recv_ctrl_blk *stp_CB = r->touched[--r->ntouched];
+          
+          if (stp_CB->state == STP_CLOSED)
+            stp_conn_close(r, stp_CB);
+          else
+            stp_ack_policy(stp_CB);
+        }
+    }
+  
+  if (n < 0 && n != STP_TIMED_OUT)
+    {
+      perror("recvmmsg");
+      r->done = -1;
+    }
+}
+
+/*
+ * Serving many senders: evict the connections that have been silent
+ * for ServerIdleMs, and those that have been in TIME_WAIT long
+ * enough.
+ */
+static void stp_sweep_timeout(stp_timer *t, void *arg)
+{
+  stp_receiver *r = (stp_receiver *) arg;
+  long long now = stp_now_ms();
+  int i;
+  
+  for (i = 0; i <= r->conns.mask; i++)
+    {
+      stp_recv_ctrl_blk *stp_CB = r->conns.buckets[i], *next;
+      
+      for (; stp_CB != NULL; stp_CB = next)
+        {
+          long long silent = now - stp_CB->lastHeard;
+          
+          next = stp_CB->hashNext;
+          if (stp_CB->state == STP_TIME_WAIT ? silent >= TIME_WAIT_MS : silent >= ServerIdleMs)
+            {
+              if (stp_CB->state != STP_TIME_WAIT)
+                stp_log(STP_LOG_INFO, "dropping idle connection from %s port %d\n",
+                        inet_ntoa(stp_CB->peer.sin_addr), ntohs(stp_CB->peer.sin_port));
+              stp_conn_close(r, stp_CB);
+            }
+        }
+    }
+  stp_timer_arm(&r->loop->timers, t, now + SWEEP_MS);
+}
+
+/*
+ * Set up a receiver on socket fd, with its event loop and connection
+ * table. Returns NULL if that failed, having released whatever it had
+ * set up; fd is still the caller's then.
+ */
+static stp_receiver *stp_receiver_new(int fd)
+{
+  stp_receiver *r = (stp_receiver *) calloc(1, sizeof(*r));
+  
+  if (r == NULL)
+    return NULL;
+  r->fd = fd;
+  if ((r->loop = (stp_loop *) malloc(sizeof(*r->loop))) == NULL)
+    goto fail;
+  if (stp_loop_init(r->loop) < 0)
+    {
+      perror("event loop");
+      goto fail;
+    }
+  r->delay_pkt = (char *)malloc(ReceiverMaxMtu);
+  if (r->delay_pkt == NULL ||
+      stp_batch_init(&r->batch, r->fd, ReceiverMaxMtu) < 0 ||
+      stp_conn_table_init(&r->conns, ReceiverServe ? ServerMaxConns : 1) < 0)
+    goto fail;
+  if (stp_loop_add(r->loop, r->fd, stp_receiver_input, r) < 0)
+    {
+      perror("event loop");
+      goto fail;
+    }
+  stp_timer_init(&r->sweepTimer, stp_sweep_timeout, r);
+  if (ReceiverServe)
+    stp_timer_arm(&r->loop->timers, &r->sweepTimer, stp_now_ms() + SWEEP_MS);
+  return r;
+  
+ fail:
+  /* Each of these is still empty (or NULL) if we did not get that far */
+  stp_conn_table_destroy(&r->conns);
+  stp_batch_destroy(&r->batch);
+  free(r->delay_pkt);
+  if (r->loop != NULL)
+    {
+      stp_loop_destroy(r->loop);
+      free(r->loop);
+    }
+  free(r);
+  return NULL;
+}
+
+/*
+ * Close every connection the receiver still has, finished or not.
+ */
+static void stp_receiver_close_all(stp_receiver *r)
+{
+  while (r->conns.count > 0)
+    {
+      int i;
       
-      if (event_happens(CorruptedPacketProbability)) {
-        int random_byte = lrand48() % len, random_bit = lrand48() % 8;
-        //printf("RECEIVED PACKET CORRUPTED: byte %d from %02x",
-        //random_byte, pkt[random_byte]);
-        printf("RECEIVED PACKET CORRUPTED\n");
-        pkt[random_byte] ^= (char) (1 << random_bit);
-        //printf(" to %02x\n", pkt[random_byte]);
+      for (i = 0; r->conns.buckets[i] == NULL; i++)
+        ;
+      stp_conn_close(r, r->conns.buckets[i]);
+    }
+}
+
+/*
+ * Release a receiver made by stp_receiver_new(), its connections and
+ * its socket. Its loop must not be running.
+ */
+static void stp_receiver_free(stp_receiver *r)
+{
+  stp_receiver_close_all(r);
+  stp_conn_table_destroy(&r->conns);
+  stp_loop_destroy(r->loop);
+  free(r->loop);
+  stp_batch_destroy(&r->batch);
+  free(r->delay_pkt);
+  close(r->fd);
+  free(r);
+}
+
+/*
+ * Process packets until the transfer is over. The receiver's loop is
+ * simple because (unlike the sender) the only timers we need to
+ * schedule are the delayed ACK, the window update and, serving, the
+ * eviction sweep; between packets and timers it sleeps. Returns 0 if
+ * the transfer was completed, -1 if not.
+ */
+static int stp_receiver_loop(stp_receiver *r)
+{
+  while (r->done == 0)
+    if (stp_loop_run(r->loop, -1) < 0)
+      {
+        perror("event loop");
+        r->done = -1;
       }
+  
+  /* The one connection, finished or not */
+  stp_receiver_close_all(r);
+  
+  return r->done < 0 ? -1 : 0;
+}
+
+static void *stp_shard_thread(void *arg)
+{
+  stp_receiver *r = (stp_receiver *) arg;
+  
+  stp_rand_seed(time(NULL) + r->shard);
+  stp_receiver_loop(r);
+  return NULL;
+}
+
+/*
+ * The CPUs we may run on: returns how many there are and, in cpus,
+ * the number of each, at most max of them. If the affinity mask
+ * cannot be read they are taken to be CPUs 0 to n - 1.
+ */
+static int stp_cpus(int *cpus, int max)
+{
+  int n = 0;
+  
+  int i;
+  
+#if defined(__linux__)
+  cpu_set_t set;
+  
+  if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+      for (i = 0; i < CPU_SETSIZE && n < max; i++)
+        if (CPU_ISSET(i, &set))
+          cpus[n++] = i;
+      return n;
+    }
+#endif
+  n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > max)
+    n = max;
+  for (i = 0; i < n; i++)
+    cpus[i] = i;
+  return n;
+}
+
+/*
+ * Sharded server: ReceiverShards threads, each with its own
+ * SO_REUSEPORT socket on rport, event loop and connection table, and
+ * each pinned to a CPU of its own (where there are enough). The
+ * kernel hashes every sender to one socket, so a connection lives in
+ * one thread only and nothing on the packet path is shared. All the
+ * sockets are bound before any thread starts, so the hashing does not
+ * change under the first senders. Runs until it is killed; returns -1
+ * if it could not start, with any shard already running stopped and
+ * every shard released.
+ */
+static int stp_receiver_shards(int rport)
+{
+  int cpus[MAX_CPUS], ncpus = stp_cpus(cpus, MAX_CPUS);
+  int i, n = ReceiverShards > 0 ? ReceiverShards : ncpus, made = 0, started = 0;
+  stp_receiver **shards = (stp_receiver **) calloc(n, sizeof(*shards));
+  
+  if (shards == NULL)
+    return -1;
+  for (made = 0; made < n; made++)
+    {
+      int fd = udp_bind(rport, 1);
       
-      pe->pkt = (char *) pkt;
-      pe->len = len;
+      if (fd < 0)
+        goto fail;
+      if ((shards[made] = stp_receiver_new(fd)) == NULL)
+        {
+          close(fd);
+          goto fail;
+        }
+      shards[made]->shard = made;
+    }
+  
+  for (i = 0; i < n; i++)
+    {
+      int err = pthread_create(&shards[i]->thread, NULL, stp_shard_thread, shards[i]);
       
-      /* Do the processing associated with a new packet arrival. But,
-       * with probability PLP, we pretend this packet got lost in the
-       * network.
-       */
-      if (event_happens(PacketLossProbability)) 
-        { 
-          printf("PACKET DROPPED\n");  /* Do nothing */
-          continue;
-        }    
-      else if (!delay_pkt_set && event_happens(OutOfOrderPacketArrivalProbability)) 
-        {        
-          printf("PACKET DELAYED\n");
-          memcpy (delay_pkt, pkt, len);
-          delay_pkt_len = len; 
-          delay_pkt_set = 1;
+      if (err != 0)
+        {
+          stp_log(STP_LOG_ERROR, "pthread_create: %s\n", strerror(err));
+          goto fail;
         }
-      else if (delay_pkt_set) 
+      started++;
+#if defined(__linux__)
+      if (n <= ncpus)
         {
-          /* Process the packets in reverse order and unset delay_pkt_set bit */
+          cpu_set_t set;
           
-          if (stp_receive_state_transition_machine(stp_CB, pe) == -1) 
-            {
-              return -1;
-            }
-	  pe->pkt = delay_pkt;
-	  pe->len = delay_pkt_len;
-          switch (stp_receive_state_transition_machine(stp_CB, pe)) 
-            {
-            case -1:
-              return -1;
-              break;
-            case 1:
-              return 0;
-              break;
-            }
-          delay_pkt_set = 0;
+          CPU_ZERO(&set);
+          CPU_SET(cpus[i], &set);
+          if (pthread_setaffinity_np(shards[i]->thread, sizeof(set), &set) != 0)
+            stp_log(STP_LOG_WARN, "could not pin shard %d to CPU %d\n", i, cpus[i]);
+          else
+            stp_log(STP_LOG_INFO, "shard %d on CPU %d\n", i, cpus[i]);
         }
-      /*  Otherwise, we're in normal operating mode */
-      else
-        switch (stp_receive_state_transition_machine(stp_CB,pe)) 
-          {
-          case -1:  /* Error */
-            return -1;
-            break;
-          case 1:   /* File transfer complete */ 
-            return 0;
-            break;
-          } 
+#endif
+    }
+  
+  for (i = 0; i < n; i++)
+    pthread_join(shards[i]->thread, NULL);
+  return -1;
+  
+ fail:
+  /* Just started, the shards running are waiting for their first packets */
+  for (i = 0; i < started; i++)
+    {
+      pthread_cancel(shards[i]->thread);
+      pthread_join(shards[i]->thread, NULL);
     }
+  for (i = 0; i < made; i++)
+    stp_receiver_free(shards[i]);
+  free(shards);
+  return -1;
 }
 
+/*
+ * Run the receiver: open the socket, then run an event loop that
+ * processes incoming packets and the timers. Without ReceiverServe
+ * the socket is connected to dst and the receiver returns once that
+ * one transfer is over; with it, packets from any sender to rport are
+ * accepted, each sender has a connection of its own, and the receiver
+ * runs until it is killed, in ReceiverShards threads if asked to.
+ */
+int stp_receiver_run(char *dst, int sport, int rport)
+{
+  stp_receiver *r;
+  int fd;
+  
+  if (ReceiverServe && ReceiverShards != 1)
+    return stp_receiver_shards(rport);
+  
+  /*
+   * Open the underlying UDP/IP communication channel. The
+   * connections are set up as their SYNs arrive.
+   */
+  fd = ReceiverServe ? udp_bind(rport, 0) : udp_open(dst, sport, rport);
+  if (fd < 0)
+    return -1;
+  if ((r = stp_receiver_new(fd)) == NULL)
+    {
+      close(fd);
+      return -1;
+    }
+  return stp_receiver_loop(r);
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: ReceiveApp [-n] [-m maxMtu] [-w window] [-v version] [-S] "
+          "[-a ackEvery] [-d ackDelayMs] [-b writerBytes] [-D] [-L level] [-t tracefile] "
+          "ReceiveDataFromHost doRecvOnPort sendResponseToPort "
+          "[packetLossProb [ACKlossProb [DelayedPacketProb "
+          "[CorruptedPacketProb [CorruptedACKProb]]]]]\n"
+          "       ReceiveApp -s [-I idleMs] [-C maxConnections] [-j threads] [other options] "
+          "doRecvOnPort [packetLossProb ...]\n"
+          "  -n  do not send SACK blocks\n"
+          "  -m  largest packet to accept, header included (default %d)\n"
+          "  -w  receive window in bytes (default %d, at most %d; %d with a v1 peer)\n"
+          "  -v  newest wire version to speak (default %d)\n"
+          "  -S  checksum with the byte sum even if the sender offers CRC32C\n"
+          "  -a  ACK at least every this many in-order segments (default %d)\n"
+          "  -d  longest delay of an ACK for in-order data, ms (default %d)\n"
+          "  -b  output the writer thread may lag behind, bytes (default %d)\n"
+          "  -D  if the sender announces the size, place data directly in the file\n"
+          "  -L  log level: 0 errors, 1 warnings, 2 progress (default), 3 debug, 4 packets\n"
+          "  -t  save the packet trace to this file on exit and on SIGUSR1\n"
+          "  -s  serve any number of senders, each into OutputFile.<address>.<port>\n"
+          "  -I  with -s, drop a connection silent for this long, ms (default %d)\n"
+          "  -C  with -s, most connections at once, per thread (default %d)\n"
+          "  -j  with -s, threads with a SO_REUSEPORT socket each, 0 for one per CPU (default 1)\n",
+          STP_DEFAULT_MAX_MTU, ReceiverMaxWin, STP_MAX_WIN_V2, STP_MAX_WIN_V1,
+          STP_VERSION_2, AckEvery, AckDelayMs, WriterSize, ServerIdleMs, ServerMaxConns);
+  exit(1);
+}
 
 int main(int argc, char **argv)
 {
   char* sendingHost;
   int sendersPort, rport;
+  int opt, status;
   
-  if (argc < 4 || argc > 9) 
+  while ((opt = getopt(argc, argv, "nm:w:v:Sa:d:b:DL:t:sI:C:j:")) != -1)
     {
-      fprintf(stderr, "usage: ReceiveApp ReceiveDataFromHost doRecvOnPort sendResponseToPort "
-              "[packetLossProb [ACKlossProb [DelayedPacketProb "
-              "[CorruptedPacketProb [CorruptedACKProb]]]]]\n");
-      exit(1);
+      switch (opt)
+        {
+        case 'n':
+          SackEnabled = 0;
+          break;
+        case 'm':
+          ReceiverMaxMtu = atoi(optarg);
+          break;
+        case 'w':
+          ReceiverMaxWin = atoi(optarg);
+          break;
+        case 'v':
+          ReceiverMaxVersion = atoi(optarg);
+          break;
+        case 'S':
+          ReceiverCrc32c = 0;
+          break;
+        case 'a':
+          AckEvery = atoi(optarg);
+          break;
+        case 'd':
+          AckDelayMs = atoi(optarg);
+          break;
+        case 'b':
+          WriterSize = atoi(optarg);
+          break;
+        case 'D':
+          ReceiverDirect = 1;
+          break;
+        case 'L':
+          stp_log_level = atoi(optarg);
+          break;
+        case 't':
+          if (stp_trace_open(optarg) < 0)
+            usage();
+          break;
+        case 's':
+          ReceiverServe = 1;
+          break;
+        case 'I':
+          ServerIdleMs = atoi(optarg);
+          break;
+        case 'C':
+          ServerMaxConns = atoi(optarg);
+          break;
+        case 'j':
+          ReceiverShards = atoi(optarg);
+          break;
+        default:
+          usage();
+        }
     }
   
-  srand48(time(NULL));
+  /* A server has no particular sender to talk to */
+  if (argc - optind < (ReceiverServe ? 1 : 3) || argc - optind > (ReceiverServe ? 6 : 8) ||
+      ReceiverMaxMtu < STP_MTU || ReceiverMaxMtu > STP_MAX_MTU ||
+      ReceiverMaxWin < STP_MSS || ReceiverMaxWin > STP_MAX_WIN_V2 ||
+      ReceiverMaxVersion < STP_VERSION_1 || ReceiverMaxVersion > STP_VERSION_2 ||
+      AckEvery < 1 || AckDelayMs < 0 ||
+      WriterSize < STP_WRITER_CHUNK || WriterSize > STP_MAX_WIN_V2 ||
+      stp_log_level < STP_LOG_ERROR || stp_log_level > STP_LOG_PKT ||
+      ServerIdleMs < 1 || ServerMaxConns < 1 || ReceiverShards < 0) 
+    usage();
+  
+  stp_rand_seed(time(NULL));
+  
+  /* A server runs until it is killed, its log must not sit in a buffer */
+  if (ReceiverServe)
+    setvbuf(stdout, NULL, _IOLBF, 0);
   
   // Extract the arguments 
-  int argIndex = 1;
-  sendingHost = argv[argIndex++];
-  rport = atoi(argv[argIndex++]);
-  sendersPort = atoi(argv[argIndex++]);
+  int argIndex = optind;
+  if (ReceiverServe) {
+    sendingHost = "any host";
+    rport = atoi(argv[argIndex++]);
+    sendersPort = 0;
+  } else {
+    sendingHost = argv[argIndex++];
+    rport = atoi(argv[argIndex++]);
+    sendersPort = atoi(argv[argIndex++]);
+  }
 
   if (argc > argIndex) {
     PacketLossProbability = strtod(argv[argIndex++], NULL);
@@ -526,28 +1566,21 @@ int main(int argc, char **argv)
     CorruptedACKProbability = strtod(argv[argIndex++], NULL);
   }
   
-  printf("Listening on port %d From host %s from port %d\n"
+  stp_log(STP_LOG_INFO, "Listening on port %d From host %s from port %d\n"
          "PacketLossProb %4.2f AckLossProb %4.2f OutOfOrderProb %4.2f\n"
          "CorruptedPacketProb %4.2f CorruptedAckProb %4.2f\n",
          rport, sendingHost, sendersPort,
          PacketLossProbability, AckLossProbability, OutOfOrderPacketArrivalProbability,
          CorruptedPacketProbability, CorruptedACKProbability);
   
-  /*
-   * Open the output file for writing.  The STP sender tranfers
-   * a file to us and we simply dump it to disk.
-   */
-  outFile = open("OutputFile", O_CREAT|O_WRONLY|O_TRUNC, 0644);
-  if (outFile < 0) 
-    {
-      perror("OutputFile could not be created");
-      return 0;
-    }
-  
   /*
    * "Run" the receiver protocol.  Application can check the return value.
+   * The STP sender tranfers a file to us and we simply dump it to
+   * disk, in a file that is created when the SYN arrives.
    */
-  if (stp_receiver_run(sendingHost, sendersPort, rport) !=  0) {
+  status = stp_receiver_run(sendingHost, sendersPort, rport);
+  
+  if (status !=  0) {
     printf("File transfer failed.\n");
   } else {
     printf("File transfer completed successfully.\n");
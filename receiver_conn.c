@@ -0,0 +1,96 @@
+/*
+ * The receiver's table of connections.
+ *
+ * A receiver serving many senders on one socket tells their packets
+ * apart by where they come from: every connection is keyed on the
+ * sender's IP address and port. The table is an array of hash
+ * buckets, each a list threaded through the control blocks
+ * themselves, so looking up the connection of a packet is one hash
+ * and, with the table sized for the load, about one compare.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "stp.h"
+
+static int bucket_of(stp_conn_table *table, struct sockaddr_in *peer)
+{
+  unsigned int h = (unsigned int) peer->sin_addr.s_addr * 2654435761u;
+
+  h ^= (unsigned int) peer->sin_port * 40503u;
+  return (int) ((h ^ (h >> 16)) & table->mask);
+}
+
+static int same_peer(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/*
+ * Set up an empty table of at least "buckets" buckets (rounded up to
+ * a power of two). Returns 0, or -1 if out of memory.
+ */
+int stp_conn_table_init(stp_conn_table *table, int buckets)
+{
+  int n = 1;
+
+  while (n < buckets)
+    n <<= 1;
+  table->buckets = (stp_recv_ctrl_blk **) calloc(n, sizeof(stp_recv_ctrl_blk *));
+  if (table->buckets == NULL)
+    return -1;
+  table->mask = n - 1;
+  table->count = 0;
+  return 0;
+}
+
+/*
+ * Frees the buckets; the connections still in the table are the
+ * caller's.
+ */
+void stp_conn_table_destroy(stp_conn_table *table)
+{
+  free(table->buckets);
+  table->buckets = NULL;
+  table->count = 0;
+}
+
+/*
+ * The connection with the sender at "peer", or NULL if there is none.
+ */
+stp_recv_ctrl_blk *stp_conn_find(stp_conn_table *table, struct sockaddr_in *peer)
+{
+  stp_recv_ctrl_blk *conn;
+
+  for (conn = table->buckets[bucket_of(table, peer)]; conn != NULL; conn = conn->hashNext)
+    if (same_peer(&conn->peer, peer))
+      return conn;
+  return NULL;
+}
+
+/*
+ * Add a connection, keyed on conn->peer, which must not be in the
+ * table yet.
+ */
+void stp_conn_insert(stp_conn_table *table, stp_recv_ctrl_blk *conn)
+{
+  stp_recv_ctrl_blk **head = &table->buckets[bucket_of(table, &conn->peer)];
+
+  conn->hashNext = *head;
+  *head = conn;
+  table->count++;
+}
+
+void stp_conn_remove(stp_conn_table *table, stp_recv_ctrl_blk *conn)
+{
+  stp_recv_ctrl_blk **pp = &table->buckets[bucket_of(table, &conn->peer)];
+
+  for (; *pp != NULL; pp = &(*pp)->hashNext)
+    if (*pp == conn)
+      {
+        *pp = conn->hashNext;
+        conn->hashNext = NULL;
+        table->count--;
+        return;
+      }
+}
@@ -3,8 +3,16 @@
  * Boston University for use in CPSC 317 at UBC.
  *
  *
- * A list that stored packets that have already been received
- * by the receiver.
+ * The receiver's reorder window: packets that have already been
+ * received but cannot be delivered yet because of a gap before them.
+ *
+ * The window is a circular array with one slot per MSS-sized segment.
+ * Slot recvQueueHead holds the segment that starts at recvQueueBase,
+ * the next one holds the segment MSS bytes further, and so on, so
+ * inserting, finding a duplicate and draining in order are all O(1).
+ * A packet that does not start on an MSS boundary relative to the
+ * base cannot be placed and is not buffered; the sender will
+ * retransmit it.
  * 
  * Version 1.0
  */
@@ -16,137 +24,213 @@
 
 void printList(stp_recv_ctrl_blk  *info)
 {
-  pktbuf *curPacket;
-  curPacket = info->recvQueue;
-  while(curPacket != NULL)
+  int i;
+  
+  for (i = 0; i < info->recvQueueSize; i++)
     {
-      printf("%d\n", curPacket->seqno);
-      curPacket = curPacket->next;
+      pktbuf *curPacket = info->recvQueue[(info->recvQueueHead + i) % info->recvQueueSize];
+      if (curPacket != NULL)
+	printf("%u\n", curPacket->seqno);
     }
   
 }
 
+/*
+ * Returns the slot for the segment starting at seqno, or -1 if such a
+ * segment has no place in the window.
+ */
+static int packet_slot(stp_recv_ctrl_blk *info, unsigned int seqno)
+{
+  unsigned int offset = minus(seqno, info->recvQueueBase);
+  
+  if (greater(info->recvQueueBase, seqno) || offset % info->mss != 0 ||
+      offset / info->mss >= info->recvQueueSize)
+    return -1;
+  
+  return (info->recvQueueHead + offset / info->mss) % info->recvQueueSize;
+}
+
+/*
+ * Allocates a reorder window of "capacity" slots, together with the
+ * pool of buffers to fill them. Returns 0 on success, -1 if out of
+ * memory.
+ */
+int init_packet_queue(stp_recv_ctrl_blk *info, int capacity)
+{
+  info->recvQueue = (pktbuf **)calloc(capacity, sizeof(pktbuf *));
+  if (info->recvQueue == NULL)
+    return -1;
+  if (stp_pool_init(&info->recvPool, capacity, info->mss) < 0)
+    {
+      free(info->recvQueue);
+      return -1;
+    }
+  
+  info->recvQueueSize = capacity;
+  info->recvQueueHead = 0;
+  info->recvQueueBase = info->NBE;
+  info->recvQueueCount = 0;
+  return 0;
+}
+
+/*
+ * Releases the reorder window and every packet still in it.
+ */
+void free_packet_queue(stp_recv_ctrl_blk *info)
+{
+  if (info->recvQueue == NULL)
+    return;
+  stp_pool_destroy(&info->recvPool);
+  free(info->recvQueue);
+  info->recvQueue = NULL;
+  info->recvQueueCount = 0;
+}
 
 /* 
- *  Adds a packet in the receive queue so that in the
- *  end the packets saved in the receive queue are sorted
- *  by the sequence number.
+ *  Adds a packet to the reorder window. Duplicates are detected and
+ *  dropped.
  *
- *  Adjusts the last byte read (info->LBRead), which in fact happens to be
- *  one less than the seqno of the first packet.
+ *  Returns 1 if the packet is buffered (or already was), 0 if it
+ *  does not fit in the window.
  */
-void add_packet(stp_recv_ctrl_blk  *info, unsigned short seqno, int len, char *data)
+int add_packet(stp_recv_ctrl_blk  *info, unsigned int seqno, int len, char *data)
 {
   pktbuf *curPacket;
+  int slot = packet_slot(info, seqno);
+  
+  if (slot < 0)
+    return 0;
   
-  curPacket = (pktbuf *)malloc(sizeof(pktbuf));
+  if (info->recvQueue[slot] != NULL)
+    return 1;
   
+  curPacket = stp_pool_get(&info->recvPool);
+  if (curPacket == NULL)
+    return 0;
+  
+  curPacket->next = NULL;
   curPacket->seqno = seqno;
   curPacket->len = len;
   memcpy(curPacket->data, data, len);
   
-  /* Find the slot where the packet fits */
-  if (info->recvQueue == NULL)
-    {
-      /* First packet on the list */
-      
-      curPacket->next = NULL;
-      info->recvQueue = curPacket;
-    }
-  else if (greater(info->recvQueue->seqno, seqno))
-    {
-      /* The packet which is added should become the first packet on the
-	 list, i.e. be inserted before the current first packet on the list */
-      
-      curPacket->next = info->recvQueue;
-      info->recvQueue = curPacket;
-    }
-  else
-    {
-      
-      /* Walk across the list, find a place for the packet 
-	 which would insert the packet between two packets:
-	 - the packet previous to the added packet should have a smaller seqno
-	 - the packet to the right of the added packet should either
-         be NULL or a packet with greater seqno */
-      pktbuf *prev = info->recvQueue, *traverse = prev->next;
-      
-      if(prev->seqno == seqno)
-        {
-          free(curPacket);
-          return;	
-	}
-      while ((traverse != NULL) && greater(seqno, traverse->seqno))
-	{
-	  prev = traverse;
-	  traverse = traverse->next;
-	}
-      
-      if (traverse == NULL)
-	{
-	  /* Appending to the end of the list */
-	  prev->next = curPacket;
-	  curPacket->next = NULL;
-	}
-      else
-	{
-	  if(traverse->seqno == seqno)
-            {
-              free(curPacket);
-              return;
-            }
-          
-	  /* Inserting into the middle of the list */
-	  prev->next = curPacket;
-	  curPacket->next = traverse;
-	}
-      
-    }
-  
+  info->recvQueue[slot] = curPacket;
+  info->recvQueueCount++;
+  return 1;
 }
 
-void free_packet(pktbuf *pbuf)
+void free_packet(stp_recv_ctrl_blk *info, pktbuf *pbuf)
 {
-  free(pbuf);
+  stp_pool_put(&info->recvPool, pbuf);
 }
 
 /*
- * Returns a packet whose sequence number equals to seqno.
- * If no such packet, returns NULL.
+ * Returns a packet whose sequence number equals to seqno and removes
+ * it from the window. If no such packet, returns NULL.
  *
  */
-pktbuf *get_packet(stp_recv_ctrl_blk *info, unsigned short seqno)
+pktbuf *get_packet(stp_recv_ctrl_blk *info, unsigned int seqno)
 {
-  pktbuf *traverse = info->recvQueue, *prev = NULL;
+  pktbuf *packet;
+  int slot;
+  
+  if (info->recvQueueCount == 0 || (slot = packet_slot(info, seqno)) < 0)
+    return NULL;
+  
+  packet = info->recvQueue[slot];
+  if (packet == NULL || packet->seqno != seqno)
+    return NULL;
   
-  while(traverse)
+  info->recvQueue[slot] = NULL;
+  info->recvQueueCount--;
+  return packet;
+}
+
+/*
+ * Slides the window forward so that it starts at nbe, the new next
+ * byte expected. Anything left in the slots that are passed over is
+ * stale and gets freed. If nbe is not a whole number of segments
+ * away (a short packet was delivered), the buffered packets are
+ * re-placed relative to the new base.
+ */
+void advance_packet_queue(stp_recv_ctrl_blk *info, unsigned int nbe)
+{
+  unsigned int offset = minus(nbe, info->recvQueueBase);
+  int i, n, size = info->recvQueueSize;
+  
+  if (offset % info->mss == 0 && offset / info->mss < size)
     {
-      if (traverse->seqno == seqno)
+      for (n = offset / info->mss; n > 0; n--)
 	{
-          
-	  /*
-	   * Unlink the node from the list 
-	   *
-	   */
-	  if (prev == NULL)
+	  if (info->recvQueue[info->recvQueueHead] != NULL)
 	    {
-	      /* The first node on the list */
-	      info->recvQueue = traverse->next;
-              
+	      free_packet(info, info->recvQueue[info->recvQueueHead]);
+	      info->recvQueue[info->recvQueueHead] = NULL;
+	      info->recvQueueCount--;
 	    }
-	  else
-	    {
-	      /* Some other node */
-	      prev->next = traverse->next;
-	    }
-          
-	  return traverse;
+	  info->recvQueueHead = (info->recvQueueHead + 1) % size;
 	}
-      
-      prev = traverse;
-      traverse = traverse->next;
+      info->recvQueueBase = nbe;
+      return;
     }
   
-  return NULL;
+  /* Misaligned (or huge) jump: rebuild the window around nbe */
+  {
+    pktbuf **old = info->recvQueue;
+    int oldHead = info->recvQueueHead;
+    
+    info->recvQueue = (pktbuf **)calloc(size, sizeof(pktbuf *));
+    info->recvQueueHead = 0;
+    info->recvQueueBase = nbe;
+    info->recvQueueCount = 0;
+    
+    for (i = 0; i < size; i++)
+      {
+	pktbuf *packet = old[(oldHead + i) % size];
+	int slot;
+	
+	if (packet == NULL)
+	  continue;
+	if (info->recvQueue == NULL || (slot = packet_slot(info, packet->seqno)) < 0)
+	  {
+	    free_packet(info, packet);
+	    continue;
+	  }
+	info->recvQueue[slot] = packet;
+	info->recvQueueCount++;
+      }
+    free(old);
+  }
+}
+
+/*
+ * Describes the buffered out-of-order data as at most "max" SACK
+ * blocks, lowest sequence numbers first, with adjacent packets merged
+ * into one block. The blocks are returned in host byte order; the
+ * return value is the number of blocks filled in.
+ */
+int get_sack_blocks(stp_recv_ctrl_blk *info, stp_sack_block *blocks, int max)
+{
+  int i, n = 0, seen = 0;
+  
+  for (i = 0; i < info->recvQueueSize && seen < info->recvQueueCount; i++)
+    {
+      pktbuf *packet = info->recvQueue[(info->recvQueueHead + i) % info->recvQueueSize];
+      
+      if (packet == NULL)
+	continue;
+      seen++;
+      
+      if (n > 0 && blocks[n - 1].end == packet->seqno)
+	{
+	  blocks[n - 1].end = plus(packet->seqno, packet->len);
+	  continue;
+	}
+      if (n == max)
+	break;
+      blocks[n].start = packet->seqno;
+      blocks[n].end = plus(packet->seqno, packet->len);
+      n++;
+    }
   
+  return n;
 }
@@ -0,0 +1,220 @@
+/*
+ * Direct placement of received data into the output file.
+ *
+ * When the sender announces the size of the transfer in its SYN, the
+ * receiver does not need a reorder window: every segment already has
+ * its place in the file, at its distance from the first byte. The file
+ * is allocated to its full size up front and mapped, each segment is
+ * copied from the receive buffer straight to its offset, and a bitmap
+ * with one bit per MSS block remembers which blocks are there. NBE
+ * moves over the blocks as the gaps before them fill.
+ *
+ * As in receiver_list.c, an out-of-order segment must start on an MSS
+ * boundary (of the file, this time) and be a whole block, the last
+ * one excepted; anything else is not placed and the sender will
+ * retransmit it. The file is opened O_RDWR for the mapping; if it
+ * cannot be mapped all the same it is written with pwrite() instead.
+ *
+ * A stripe of a file that comes over several connections (fileBase
+ * not negative) is written with pwrite() at fileBase on: the other
+ * stripes are writing the same file, so its size and mapping are not
+ * this connection's to decide.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stp.h"
+
+#define BIT_SET(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define SET_BIT(map, i)  ((map)[(i) >> 3] |= (1 << ((i) & 7)))
+
+/* Bytes in the block that starts at file offset "off" */
+static long long block_len(stp_recv_ctrl_blk *info, long long off)
+{
+  return info->fileSize - off < info->mss ? info->fileSize - off : info->mss;
+}
+
+/*
+ * Prepare to place a transfer of "size" bytes into fd. Returns 0 on
+ * success, -1 (with errno set) if the bitmap or the disk space for
+ * the file could not be had.
+ */
+int init_output_map(stp_recv_ctrl_blk *info, int fd, long long size)
+{
+  long long blocks = (size + info->mss - 1) / info->mss;
+  void *map = MAP_FAILED;
+  int err;
+
+  info->placed = (unsigned char *) calloc(blocks / 8 + 1, 1);
+  if (info->placed == NULL)
+    return -1;
+
+  if (size > 0 && info->fileBase >= 0)
+    {
+      /* Only our range; the file grows to take in every stripe */
+      err = posix_fallocate(fd, info->fileBase, size);
+      if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+        {
+          free(info->placed);
+          info->placed = NULL;
+          errno = err;
+          return -1;
+        }
+    }
+  else if (size > 0)
+    {
+      /* Claim the space now, so a full disk fails the SYN and not the transfer */
+      err = posix_fallocate(fd, 0, size);
+      if (err != 0 && err != EOPNOTSUPP && err != EINVAL)
+        {
+          free(info->placed);
+          info->placed = NULL;
+          errno = err;
+          return -1;
+        }
+      if (ftruncate(fd, size) < 0)
+        {
+          free(info->placed);
+          info->placed = NULL;
+          return -1;
+        }
+      /* A file system that cannot map the file still takes pwrite() */
+      map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        stp_log(STP_LOG_DEBUG, "mmap of OutputFile: %s\n", strerror(errno));
+    }
+
+  info->direct = 1;
+  info->fileSize = size;
+  info->nbeOffset = 0;
+  info->outFd = fd;
+  info->outMap = map == MAP_FAILED ? NULL : (char *) map;
+  return 0;
+}
+
+/*
+ * Write len bytes of the segment starting at seqno (not before NBE)
+ * to their place in the file. Duplicates of blocks already there are
+ * recognised and not written again.
+ *
+ * Returns 1 if the data is in the file (or already was), 0 if it has
+ * no place there, -1 if the file could not be written.
+ */
+int place_packet(stp_recv_ctrl_blk *info, unsigned int seqno, int len, char *data)
+{
+  long long off = info->nbeOffset + minus(seqno, info->NBE);
+  long long block = off / info->mss;
+  long long base = info->fileBase > 0 ? info->fileBase : 0;
+  int whole = off % info->mss == 0 && len == block_len(info, off);
+  int done = 0;
+
+  if (off + len > info->fileSize)
+    return 0;
+  if (seqno != info->NBE && !whole)
+    return 0;
+  if (whole && BIT_SET(info->placed, block))
+    return 1;
+
+  if (info->outMap != NULL)
+    memcpy(info->outMap + off, data, len);
+  else
+    while (done < len)
+      {
+        ssize_t n = pwrite(info->outFd, data + done, len - done, base + off + done);
+
+        if (n < 0)
+          {
+            if (errno == EINTR)
+              continue;
+            return -1;
+          }
+        done += n;
+      }
+
+  if (whole)
+    SET_BIT(info->placed, block);
+  return 1;
+}
+
+/*
+ * The len bytes at NBE have just been placed; move past them and
+ * past any blocks after them that were already there. Returns the
+ * number of bytes NBE moves forward.
+ */
+unsigned int advance_output_map(stp_recv_ctrl_blk *info, int len)
+{
+  long long start = info->nbeOffset;
+
+  info->nbeOffset += len;
+  while (info->nbeOffset < info->fileSize && info->nbeOffset % info->mss == 0 &&
+         BIT_SET(info->placed, info->nbeOffset / info->mss))
+    info->nbeOffset += block_len(info, info->nbeOffset);
+
+  return (unsigned int) (info->nbeOffset - start);
+}
+
+/*
+ * Describes the blocks placed beyond NBE as at most "max" SACK blocks,
+ * the same way get_sack_blocks() does for the reorder window. Only
+ * one window's worth of the bitmap is looked at.
+ */
+int get_map_sack_blocks(stp_recv_ctrl_blk *info, stp_sack_block *blocks, int max)
+{
+  long long off = (info->nbeOffset + info->mss - 1) / info->mss * info->mss;
+  long long end = info->nbeOffset + info->maxWin;
+  int n = 0, open = 0;
+
+  if (end > info->fileSize)
+    end = info->fileSize;
+
+  for (; off < end; off += info->mss)
+    {
+      unsigned int seqno = plus(info->NBE, (unsigned int) (off - info->nbeOffset));
+
+      if (!BIT_SET(info->placed, off / info->mss))
+        {
+          open = 0;
+          continue;
+        }
+      if (open)
+        {
+          blocks[n - 1].end = plus(seqno, (unsigned int) block_len(info, off));
+          continue;
+        }
+      if (n == max)
+        break;
+      blocks[n].start = seqno;
+      blocks[n].end = plus(seqno, (unsigned int) block_len(info, off));
+      n++;
+      open = 1;
+    }
+
+  return n;
+}
+
+/*
+ * The transfer is over. Unmaps the file and cuts it to what was
+ * actually received, in case the sender sent less than it announced;
+ * a stripe leaves the file as it is. Returns 0, or -1 if that failed.
+ */
+int close_output_map(stp_recv_ctrl_blk *info)
+{
+  int ret = 0;
+
+  if (info->outMap != NULL)
+    {
+      ret = munmap(info->outMap, info->fileSize);
+      info->outMap = NULL;
+    }
+  if (info->fileBase < 0 && info->nbeOffset < info->fileSize &&
+      ftruncate(info->outFd, info->nbeOffset) < 0)
+    ret = -1;
+  free(info->placed);
+  info->placed = NULL;
+  return ret;
+}
@@ -2,8 +2,8 @@
  * Adapted from a course at Boston University for use in CPSC 317 at UBC
  * 
  *
- * The interfaces for the STP sender (you get to implement them), and a 
- * simple application-level routine to drive the sender.  
+ * A simple application-level routine to drive the STP sender, which
+ * is in sender_conn.c (libstp, see libstp.h).
  *
  * This routine reads the data to be transferred over the connection
  * from a file specified and invokes the STP send functionality to 
@@ -15,14 +15,17 @@
  *************************************************************************/
 
 #include <sys/time.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -34,419 +37,179 @@
 
 
 #include "stp.h"
-#define PKT_SIZE 4096
-#define STP_SUCCESS 1
-#define STP_ERROR -1
+#include "libstp.h"
 
+stp_sender_config SenderConfig; /* of every connection, from the options */
+int SenderMapInput = 1;         /* send a regular file straight from a mapping of it */
+int SenderStripes = 1;          /* connections a regular file is split over */
 
-//Sender states
-#define STP_SYN_SENT   0x24
-#define STP_CLOSING   0x25
-#define FIN_WAIT   0x26	//We do not neet to implement this state.
-#define ARRAYSIZE 25 // ceiling of (receiver window size of 5000 / MTU of 300 ) is 17 so allocating 25
+#define READAHEAD (8 * 1024 * 1024) /* mapped input to have read in ahead of sending */
 
-int SenderMaxWin = 5000;        /* Maximum window size */
-
-
-typedef struct {
-  
-	int state;	 /* protocol state: normally ESTABLISHED */
-	int sock; 	/* UDP socket descriptor */
-
-	unsigned short swnd;       // latest advertised sender window size
-	unsigned short NBE;        // next byte expected - next ACK seq Num expected
-	unsigned short NextSeqNum;     // last byte ACKed = next ACK SEQ Num - length
-	unsigned short LBSent; 	// last byte Sent not ACKed
-
-	unsigned short numBytesInFlight;
-	unsigned short ISN;        /* initial sequence number */
-
-	unsigned short seqArray[25]; // pointer to seqnumber array
-	struct itimerval timeArray[25]; // pointer to array of itimerval DATA
-
-
-	//pktbuf *sendQueue;         /* Pointer to the first node of the send queue */
-     
-} stp_send_ctrl_blk;
+/*
+ * Print the final counters of a connection, which the library leaves
+ * to us. The "sender:" line is what bench.sh reads.
+ */
+static void printStats(stp_sender_stats *st)
+{
+	printf("sender: %lu segments sent, %lu retransmitted\n", st->segsSent, st->segsRetrans);
+	if (st->cc == NULL)
+		return;
+	printf("send pool: %d buffers of %d bytes, high water %d, %lu allocs, %lu failures\n",
+	       st->poolBuffers, st->poolBufferSize, st->poolHighWater,
+	       st->poolAllocs, st->poolFailures);
+	printf("%s: cwnd %u ssthresh %u, %lu losses, %lu timeouts\n", st->cc,
+	       st->cwnd, st->ssthresh, st->losses, st->timeouts);
+}
 
-//Returns 0 if two unsigned char are equal. 
-int compareSum(unsigned char* a,unsigned char* b, int size)
+/*
+ * Send the "len" bytes at "off" in the file. From a mapping, a few MB
+ * at a time, a whole number of segments each, asking for the next
+ * piece to be read in while this one goes; otherwise read with
+ * pread(), one MSS at a time. Returns STP_SUCCESS or STP_ERROR.
+ */
+static int sendRange(stp_send_ctrl_blk *stp_CB, int file, unsigned char *map,
+		     long long off, long long len)
 {
-	while(size-- > 0) 
+	long long end = off + len;
+
+	if (map != NULL)
 	{
-		if ( *a != *b ) 
-		{ 
-			return (*a < *b ) ? -1 : 1; 
+		long long chunk = READAHEAD / stp_mss(stp_CB) * stp_mss(stp_CB), next;
+		long page = sysconf(_SC_PAGESIZE);
+
+		madvise(map + (off & ~(long long) (page - 1)), len < chunk ? len : chunk,
+			MADV_WILLNEED);
+		for (; off < end; off += chunk)
+		{
+			int n = end - off < chunk ? end - off : chunk;
+
+			next = (off + chunk) & ~(long long) (page - 1);
+			if (next < end)
+				madvise(map + next, end - next < chunk ? end - next : chunk,
+					MADV_WILLNEED);
+			if (stp_send_mapped(stp_CB, map + off, n) == STP_ERROR)
+				return STP_ERROR;
 		}
-		a++; b++;
+		return STP_SUCCESS;
 	}
-	return 0;
 
-	
-} 
+	/* One MSS at a time; the MSS is only known once the connection is up */
+	unsigned char *buffer = malloc(stp_mss(stp_CB));
+	int ret = STP_SUCCESS;
 
-//Read packet (stop and wait approach)
-int readPacket(stp_send_ctrl_blk *stp_CB, char *pkt, unsigned short int type)
-{
-	int readTemp = readWithTimer(stp_CB->sock, pkt, 1000);
-	int numberofTimeouts =0;
-	unsigned short seqNum;
-	if(type == STP_FIN)
-	{
-		seqNum = stp_CB->NextSeqNum;
-	}
-	else if(type==STP_SYN)
-		seqNum = stp_CB->ISN;
-		
-	else
-		seqNum = stp_CB->NextSeqNum;
-	
-	
-	while (readTemp==STP_TIMED_OUT){
-			printf("Sorry timed out...\n ");
-			
-			numberofTimeouts++;
-			switch (numberofTimeouts)
-			{
-			case 1 : sendpkt(stp_CB-> sock, type, 0, seqNum, 0,0);
-				readTemp = readWithTimer(stp_CB->sock, pkt, 2000);
-				break;
-			case 2 : sendpkt(stp_CB-> sock, type, 0, seqNum, 0,0);
-				readTemp = readWithTimer(stp_CB->sock, pkt, 4000);
-				break;
-			case 3 : reset(stp_CB->sock);
-				break;
-			}
-		
-	}
-	
-	stp_header *stpHeader = (stp_header *) pkt;
-	unsigned char sum = checksum(stpHeader, 0);
-	unsigned char originalSum = stpHeader->checksum;
-	
-	unsigned char* sumPt = &sum;
-	unsigned char* originalSumPt = &originalSum;
-	//printf("Check Sum: %d\n", compareSum(sumPt, originalSumPt, sizeof(sum)));
-	if(compareSum(sumPt, originalSumPt, sizeof(sum)) != 0)
+	if (buffer == NULL)
+		return STP_ERROR;
+	while (off < end && ret == STP_SUCCESS)
 	{
-		printf("ACK was corrupted. Retransmit\n");
-		memset(pkt, 0, PKT_SIZE);
-		
-		sendpkt(stp_CB-> sock, type, 0, seqNum, 0,0);
-		readTemp = readPacket(stp_CB, pkt,type);
-		
-	}
-	
-	return readTemp;
-}
+		int n = end - off < stp_mss(stp_CB) ? end - off : stp_mss(stp_CB);
 
-void setTimer(stp_send_ctrl_blk *stp_CB, int ms){
-	// assumes the LBSent is the most recent
-	int i=0;
-	while(i<25){
-		// curious about checking for seqnum of 0
-		// check for 1 sec initial timeout and find check first avail seqArray[i] for 0 and then using index i complete the timeArray[i]
-		if(ms==1000){
-		if(stp_CB->seqArray[i]==0 && (double)stp_CB->timeArray[i].it_value.tv_sec==0.0 && (double)stp_CB->timeArray[i].it_value.tv_usec==0.0){
-			stp_CB->seqArray[i]=stp_CB->LBSent;
-			stp_CB->timeArray[i].it_interval.tv_sec =0; // repeat 0 seconds 
-			stp_CB->timeArray[i].it_interval.tv_usec = 0; // repeat 0 microseconds time
-			stp_CB->timeArray[i].it_value.tv_sec =ms/1000; // set timer to go off in ms/1000 seconds
-			stp_CB->timeArray[i].it_value.tv_usec =0; // microseconds of time to go off in default to 0 microseconds
-			setitimer(ITIMER_REAL, &stp_CB->timeArray[i],0);
+		n = pread(file, buffer, n, off);
+		if (n <= 0)
 			break;
-			}
-		}
-		else if(ms==2000||ms==4000){
-			if(stp_CB->seqArray[i]==stp_CB->LBSent){
-			stp_CB->timeArray[i].it_interval.tv_sec =0; // repeat 0 seconds 
-			stp_CB->timeArray[i].it_interval.tv_usec = 0; // repeat 0 microseconds time
-			stp_CB->timeArray[i].it_value.tv_sec =ms/1000; // set timer to go off in ms/1000 seconds
-			stp_CB->timeArray[i].it_value.tv_usec =0; // microseconds of time to go off in default to 0microseconds					
-			setitimer(ITIMER_REAL, &stp_CB->timeArray[i],0);
-			break;		
-			}
-		}
-	i++;
+		ret = stp_send(stp_CB, buffer, n);
+		off += n;
 	}
+	free(buffer);
+	return ret;
 }
 
-// resets timers after receiving ack, to be called from check ack
-void resetTimer(stp_send_ctrl_blk *stp_CB){
-	int i=0;
-	while (i < 25){
-		if(stp_CB->seqArray[i]==stp_CB->LBSent){
-			stp_CB->seqArray[i]=0;
-			stp_CB->timeArray[i].it_interval.tv_sec =0; // repeat 0 seconds 
-			stp_CB->timeArray[i].it_interval.tv_usec = 0; // repeat 0 microseconds time
-			stp_CB->timeArray[i].it_value.tv_sec =0; // set timer to go off in ms/1000 seconds
-			stp_CB->timeArray[i].it_value.tv_usec =0; // microseconds of time to go off in default to 0microseconds				
-			break;
-		}
-	i++;
-	}
-}
-
-
-
 /*
- * Send STP. This routine is to send a data packet no greater than
- * MSS bytes. If more than MSS bytes are to be sent, the routine
- * breaks the data into multiple packets. It will keep sending data
- * until the send window is full. At which point it reads data from
- * the network to, hopefully, get the ACKs that open the window. You
- * will need to be careful about timing your packets and dealing with
- * the last piece of data.
- * 
- * The function returns STP_SUCCESS on success, or STP_ERROR on error.
+ * One stripe of a file sent over several connections: the bytes at
+ * [off, off + len) go over their own connection, from their own
+ * thread.
  */
-int stp_send (stp_send_ctrl_blk *stp_CB, unsigned char* data, int length) {
-  
-
-  char* data1 = (char *)data;
-  sendpkt(stp_CB->sock, STP_DATA, stp_CB->swnd, stp_CB->NextSeqNum, data1, length);
- 
-	//checks if the latest seqno sent is larger than the NBE and stores it as stp_CB->LBSent (last byte sent)
-	// using wraparound methods
-
-// check using greater method from wraparound if seqno is greater than ISN as well as greater than last stp_CB.LBSent
-	if((greater(stp_CB->NextSeqNum, stp_CB->LBSent)==1))
-		stp_CB->LBSent = stp_CB->NextSeqNum; // want to update LBSent to the NextSeqNum
-
- 
-  char pkt[PKT_SIZE];
-	
-	int readTemp = readPacket(stp_CB, pkt, STP_DATA);
-	if (readTemp<0){
-		return STP_ERROR;
-	}
-	
-	printf("Received packet back\n");
-	
-	
-		
-	stp_header *stpHeader = (stp_header *) pkt;
-  	//unsigned short type = ntohs(stpHeader->type);
-  	unsigned short seqno = ntohs(stpHeader->seqno);
-  	unsigned short win = ntohs(stpHeader->window);
-	stp_CB->NextSeqNum = seqno;
-	stp_CB->NBE = (seqno+length);
-	stp_CB->swnd = win;
-
-
-	// checkTimer(stp_CB);
-  
-  return STP_SUCCESS;
-}
- 
-//Creates UDP sockets
-int open_udp(char *destination, int destinationPort,int receivePort)
+typedef struct {
+	char *destination;
+	int destinationPort;
+	int receivePort;
+	int file;
+	unsigned char *map;        // the file mapped, or NULL to pread() it
+	unsigned int transfer;     // the same for all the stripes of the file
+	long long off;
+	long long len;
+	pthread_t thread;
+	int status;                // STP_SUCCESS or STP_ERROR
+} stripe;
+
+static void *stripeThread(void *arg)
 {
-	int      fd;
-	uint32_t dst;
-	struct   sockaddr_in sin;
-  
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (fd < 0) 
+	stripe *sp = (stripe *) arg;
+	stp_send_ctrl_blk *stp_CB;
+	stp_sender_stats st;
+	int ret;
+
+	sp->status = STP_ERROR;
+	stp_CB = stp_open_stripe(&SenderConfig, sp->destination, sp->destinationPort, sp->receivePort,
+				 sp->len, sp->transfer, sp->off);
+	if (stp_CB == NULL)
 	{
-      perror("Error creating UDP socket");
-      return -1;
-    }
-  
-	/* Bind the local socket to listen at the local_port. */
-	printf ("Binding locally to port %d\n", receivePort);
-	memset((char *)&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(receivePort);
-  
-	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) 
-    {
-      perror("Bind failed");
-      return (-2);
-    }
-  
-	dst = hostname_to_ipaddr(destination);
-  
-	if (!dst) {
-		printf("Invalid sending host name: %s\n", destination);
-		return -4;
+		perror("stripe: stp_control_block cannot be NULL");
+		return NULL;
 	}
-	printf ("Configuring  UDP \"connection\" to <%u.%u.%u.%u, port %d>\n", 
-          (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF, 
-          (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF, destinationPort);
-  
-	memset((char *)&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(destinationPort);
-	sin.sin_addr.s_addr = dst;
-	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) 
+	if (sendRange(stp_CB, sp->file, sp->map, sp->off, sp->len) == STP_ERROR)
 	{
-      perror("connect");
-      return(-1);
+		perror("stripe: STP_ERROR on send");
+		return NULL;
 	}
-	printf ("UDP \"connection\" to <%u.%u.%u.%u port %d> configured\n", 
-          (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF, 
-          (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF , destinationPort);
-	
-	
-	return fd;
+	ret = stp_close_stats(stp_CB, &st);
+	printStats(&st);
+	if (ret == STP_ERROR)
+	{
+		perror("stripe: STP_CLOSE error");
+		return NULL;
+	}
+	sp->status = STP_SUCCESS;
+	return NULL;
 }
 
-
-
-
-
-
 /*
- * Open the sender side of the STP connection. Returns the pointer to
- * a newly allocated control block containing the basic information
- * about the connection. Returns NULL if an error happened.
- *
- * Note, to simplify things you should use connect(). When used with a
- * UDP socket all packets then sent and received on the given file
- * descriptor go to and are received from the specified host. Reads
- * and writes are still completed in a datagram unit size, but the
- * application does not have to do the multiplexing and
- * demultiplexing. This greatly simplifies things but restricts the
- * number of "connections" to the number of file descriptors and isn't
- * very good for a pure request response protocol like DNS where there
- * is no long term relationship between the client and server.
+ * Send the file as SenderStripes stripes of about equal size, each a
+ * whole number of pages, at the same time. Stripe i is sent from
+ * receivePort + i. Returns STP_SUCCESS if all of them got there.
  */
-stp_send_ctrl_blk * stp_open(char *destination, int destinationPort,
-                             int receivePort) {
-
-    unsigned int iseed = (unsigned int) time(NULL);
-	srand(iseed);
+static int sendStriped(char *destination, int destinationPort, int receivePort,
+		       int file, unsigned char *map, long long size)
+{
+	stripe *stripes = calloc(SenderStripes, sizeof(stripe));
+	long page = sysconf(_SC_PAGESIZE);
+	long long each = (size + SenderStripes - 1) / SenderStripes;
+	unsigned int transfer = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+	int i, n = 0, ret = STP_SUCCESS;
 
-	// pseudo random seqnumber to start the tcp communication
-	int tempISN = 5+ (int)((rand()%(100)));
-	printf("MAX_RAND %d\n", tempISN);
-	
-	printf ("Configuring  UDP \"connection\" to %s, sending to port %d listening for data on port %d\n", 
-          destination, destinationPort, receivePort);
-    
-	stp_send_ctrl_blk *stp_CB = (stp_send_ctrl_blk *) malloc(sizeof(*stp_CB));
-	
-		
-	
-	if ((stp_CB->sock = open_udp(destination, destinationPort,receivePort) ) < 0) /* UDP socket descriptor */
-	{
-		return NULL; 
-	}
-	
-	stp_CB->swnd = SenderMaxWin;    /* latest advertised sender window */
-	//stp_CB->NBE = 0;        /* next byte expected */
-	stp_CB->NextSeqNum =0;     /* last byte ACKed */
-	
-	stp_CB->ISN = tempISN;        //initial sequence number should not be zero, this is a random number
-	stp_CB->LBSent=stp_CB->ISN; 	/* last byte Sent not ACKed */
+	if (stripes == NULL)
+		return STP_ERROR;
+	each = (each + page - 1) / page * page;
 
-	//stp_CB->sendQueue;
-	
-	sendpkt(stp_CB-> sock, STP_SYN, 0, stp_CB->ISN, 0,0);
-	stp_CB->state = STP_SYN_SENT;	 /* protocol state*/
-	
-	char pkt[PKT_SIZE];
-	
-	int readTemp = readPacket(stp_CB, pkt, STP_SYN);
-	if (readTemp<0){
-		return NULL;
-	}
-	
-	printf("Received packet back\n");
-	
-	/*
-	stp_header *stpHeader = (stp_header *) pkt;
-	unsigned char sum = checksum(stpHeader, 0);
-	unsigned char originalSum = stpHeader->checksum;
-	
-	unsigned char* sumPt = &sum;
-	unsigned char* originalSumPt = &originalSum;
-	//printf("Check Sum: %d\n", compareSum(sumPt, originalSumPt, sizeof(sum)));
-	if(compareSum(sumPt, originalSumPt, sizeof(sum)) != 0)
+	for (i = 0; i < SenderStripes && (long long) i * each < size; i++)
 	{
-		printf("ACK was corrupted. Retransmit\n");
-		memset(pkt, 0, PKT_SIZE);
-		
-		sendpkt(stp_CB-> sock, STP_SYN, 0, stp_CB->ISN, 0,0);
-		readTemp = readPacket(stp_CB, pkt,STP_SYN);
-		
-	}
-	*/
-	
-	stp_CB->state = STP_ESTABLISHED;
-	
-	stp_header *stpHeader = (stp_header *) pkt;
-  	//unsigned short type = ntohs(stpHeader->type);
-  	unsigned short seqno = ntohs(stpHeader->seqno);
-  	unsigned short win = ntohs(stpHeader->window);
-	stp_CB->NextSeqNum = seqno;
-	stp_CB->swnd = win;
-
-	
-
-
-
-	// print out the arrays for testing purpose
-/*
-	int i=0;
-	while(i<25){
-		printf("array seqnum/timer has: at %d :", i);
-		printf("seqnum: %d\n", stp_CB->seqArray[i]);
-		printf("timeArray: %2.1f\n", (double)stp_CB->timeArray[i].tv_sec);
-		i++;
-		
+		stripe *sp = &stripes[i];
+
+		sp->destination = destination;
+		sp->destinationPort = destinationPort;
+		sp->receivePort = receivePort + i;
+		sp->file = file;
+		sp->map = map;
+		sp->transfer = transfer;
+		sp->off = (long long) i * each;
+		sp->len = size - sp->off < each ? size - sp->off : each;
+		if (pthread_create(&sp->thread, NULL, stripeThread, sp) != 0)
+		{
+			perror("pthread_create");
+			ret = STP_ERROR;
+			break;
+		}
+		n++;
 	}
-*/
-
 
-	//dump('r', pkt, readTemp);
-	//stp_CB->NextSeqNum = tempISN+1;
-
-	
-	//int readTemp = readpkt(stp_CB->sock, pkt, sizeof(pkt));
-	//printf("%s\n", pkt);
-	
-	return stp_CB;
-}
-
-
-
-/*
- * Make sure all the outstanding data has been transmitted and
- * acknowledged, and then initiate closing the connection. This
- * function is also responsible for freeing and closing all necessary
- * structures that were not previously freed, including the control
- * block itself. Returns STP_SUCCESS on success or STP_ERROR on error.
- */
-int stp_close(stp_send_ctrl_blk *stp_CB) {
-	stp_CB->state = STP_CLOSING;
-  
-	/* This will be for any outstanding data. 
-	while(stp_CB->NextSeqNum != stp_CB->ISN)
+	for (i = 0; i < n; i++)
 	{
-		//receive rest of packet
-	}*/
-
-	sendpkt(stp_CB->sock, STP_FIN, 0, stp_CB->NextSeqNum, 0,0);
-  
-	char pkt[PKT_SIZE];
-	int readTemp = readPacket(stp_CB, pkt, STP_FIN);
-	printf("Read Temp: %d\n", readTemp);
-	if (readTemp<0){
-		close(stp_CB->sock);
-		free(stp_CB);
-		return STP_ERROR;
+		pthread_join(stripes[i].thread, NULL);
+		if (stripes[i].status == STP_ERROR)
+			ret = STP_ERROR;
 	}
-	
-	
-	//printf("Window: %d\n", stp_CB->swnd);
-	//printf("%s\n",pkt);
-	printf("Connection Closed\n");
-	close(stp_CB->sock);
-	free(stp_CB);
-	
-	return STP_SUCCESS;
+	stp_log(STP_LOG_INFO, "%d stripes of %lld bytes, transfer %08x\n", n, each, transfer);
+	free(stripes);
+	return ret;
 }
 
 
@@ -461,24 +224,114 @@ int stp_close(stp_send_ctrl_blk *stp_CB) {
  * - A program that reads the standard input and transmits it through
  *   STP;
  */
+static void usage(void)
+{
+  stp_sender_config defaults;
+  
+  stp_config_defaults(&defaults);
+  fprintf(stderr, "usage: SendApp [-r minRtoMs] [-R maxRtoMs] [-z] [-m maxMtu] [-P] [-w window] [-v version] [-S] [-c cc] [-p Mbps] [-T] [-M] [-N stripes] [-L level] [-t tracefile] "
+          "DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename \n"
+          "  -m  largest packet to offer, header included (default %d)\n"
+          "  -P  set DF and also bound the MTU by the path MTU\n"
+          "  -w  maximum send window in bytes (default %d, at most %d; %d with a v1 peer)\n"
+          "  -v  newest wire version to offer (default %d)\n"
+          "  -S  checksum with the byte sum, do not offer CRC32C\n"
+          "  -c  congestion control: newreno (or aimd), cubic (default)\n"
+          "  -p  never send faster than this many Mbit/s\n"
+          "  -T  let the kernel release paced packets (SO_TXTIME, needs the fq qdisc)\n"
+          "  -M  read() the file rather than sending it from a mapping\n"
+          "  -z  send large segments of the mapping with MSG_ZEROCOPY (not with -M)\n"
+          "  -N  send the file over this many connections at once, from receiveDataOnPort,\n"
+          "      receiveDataOnPort + 1, ...; the receiver has to be serving (ReceiveApp -s)\n"
+          "  -L  log level: 0 errors, 1 warnings, 2 progress (default), 3 debug, 4 packets\n"
+          "  -t  save the packet trace to this file on exit and on SIGUSR1\n",
+          defaults.maxMtu, defaults.maxWin, STP_MAX_WIN_V2, STP_MAX_WIN_V1,
+          defaults.maxVersion);
+  exit(1);
+}
+
 int main(int argc, char **argv) {
   
   stp_send_ctrl_blk *stp_CB;
+  int opt;
   
   char *destinationHost;
   int receivePort, destinationPort;
   int file;
+  struct stat st;
+  unsigned char *map = NULL;
+  stp_sender_stats stats;
+  int ret;
   
-  /* You might want to change the size of this buffer to test how your
-   * code deals with different packet sizes.
-   */
-  unsigned char buffer[STP_MSS];
+  /* Input that is not a regular file: one MSS at a time */
+  unsigned char *buffer;
   int num_read_bytes;
   
+  stp_config_defaults(&SenderConfig);
+  while ((opt = getopt(argc, argv, "r:R:zm:Pw:v:Sc:p:TMN:L:t:")) != -1) {
+    switch (opt) {
+    case 'r':
+      SenderConfig.rtoMinMs = atoi(optarg);
+      break;
+    case 'R':
+      SenderConfig.rtoMaxMs = atoi(optarg);
+      break;
+    case 'z':
+      SenderConfig.zeroCopy = 1;
+      break;
+    case 'm':
+      SenderConfig.maxMtu = atoi(optarg);
+      break;
+    case 'P':
+      SenderConfig.pathMtu = 1;
+      break;
+    case 'w':
+      SenderConfig.maxWin = atoi(optarg);
+      break;
+    case 'v':
+      SenderConfig.maxVersion = atoi(optarg);
+      break;
+    case 'S':
+      SenderConfig.crc32c = 0;
+      break;
+    case 'c':
+      SenderConfig.congestion = optarg;
+      break;
+    case 'p':
+      SenderConfig.maxRate = atof(optarg) / 8;   /* Mbit/s to bytes per us */
+      break;
+    case 'T':
+      SenderConfig.txTime = 1;
+      break;
+    case 'M':
+      SenderMapInput = 0;
+      break;
+    case 'N':
+      SenderStripes = atoi(optarg);
+      break;
+    case 'L':
+      stp_log_level = atoi(optarg);
+      break;
+    case 't':
+      if (stp_trace_open(optarg) < 0)
+        usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  
   /* Verify that the arguments are right*/
-  if (argc != 5) {
-    fprintf(stderr, "usage: SendApp DestinationIPAddress/Name receiveDataOnPort sendDataToPort filename \n");
-    exit(1);
+  if (argc != 5 || SenderConfig.rtoMinMs < STP_TIMER_TICK_MS ||
+      SenderConfig.rtoMaxMs < SenderConfig.rtoMinMs ||
+      SenderConfig.maxMtu < STP_MTU || SenderConfig.maxMtu > STP_MAX_MTU ||
+      SenderConfig.maxWin < 1 || SenderConfig.maxWin > STP_MAX_WIN_V2 ||
+      SenderConfig.maxVersion < STP_VERSION_1 || SenderConfig.maxVersion > STP_VERSION_2 ||
+      stp_cc_find(SenderConfig.congestion) == NULL || SenderConfig.maxRate < 0 || SenderStripes < 1 ||
+      stp_log_level < STP_LOG_ERROR || stp_log_level > STP_LOG_PKT) {
+    usage();
   }
   
   /*
@@ -490,48 +343,90 @@ int main(int argc, char **argv) {
   receivePort = atoi(argv[2]);
   destinationPort = atoi(argv[3]);
   
-  stp_CB = stp_open(destinationHost, destinationPort, receivePort);
+  /* Open file for transfer; if it is a regular file, announce its size */
+  file = open(argv[4], O_RDONLY);
+  if (file < 0) {
+    perror(argv[4]);
+    exit(1);
+  }
+  if (fstat(file, &st) < 0 || !S_ISREG(st.st_mode))
+    st.st_size = -1;
+  
+  /*
+   * A regular file is mapped and sent from the mapping: no read() or
+   * copy per segment, and retransmissions come from the page cache.
+   * The kernel reads ahead of us, see below.
+   */
+  if (st.st_size <= 0)
+    SenderMapInput = 0;
+  if (SenderMapInput) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+    if (map == MAP_FAILED) {
+      perror("mmap, reading the file instead");
+      SenderMapInput = 0;
+    } else
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+  }
+  SenderConfig.segmentCopy = !SenderMapInput;
+  
+  /* A regular file may go over several connections at once */
+  if (SenderStripes > 1 && st.st_size > 0) {
+    if (sendStriped(destinationHost, destinationPort, receivePort, file,
+                    SenderMapInput ? map : NULL, st.st_size) == STP_ERROR)
+      exit(1);
+    if (SenderMapInput)
+      munmap(map, st.st_size);
+    close(file);
+    return 0;
+  }
+  
+  stp_CB = stp_open_stripe(&SenderConfig, destinationHost, destinationPort, receivePort,
+                           st.st_size, 0, -1);
   if (stp_CB == NULL) {
     /* YOUR CODE HERE */
 	perror("stp_control_block cannot be NULL");
 	exit(1);
   }
   
-  /* Open file for transfer */
-  file = open(argv[4], O_RDONLY);
-  if (file < 0) {
-    perror(argv[4]);
+  /*
+   * A regular file is sent by sendRange(), from the mapping if there
+   * is one. Anything else is read and sent as it comes: chop it up
+   * into pieces as large as max packet size and transmit those pieces.
+   */
+  if (st.st_size >= 0) {
+    if (sendRange(stp_CB, file, SenderMapInput ? map : NULL, 0, st.st_size) == STP_ERROR) {
+      perror("STP_ERROR on send");
+      exit(1);
+    }
+  } else if ((buffer = malloc(stp_mss(stp_CB))) == NULL) {
+    perror("malloc");
     stp_close(stp_CB);
     exit(1);
-  }
-  
-  /* Start to send data in file via STP to remote receiver. Chop up
-   * the file into pieces as large as max packet size and transmit
-   * those pieces.
-   */
-  while(1) {
-    num_read_bytes = read(file, buffer, sizeof(buffer));
-    
-    /* Break when EOF is reached */
-    if(num_read_bytes <= 0)
-      break;
-    
-    if(stp_send(stp_CB, buffer, num_read_bytes) == STP_ERROR) {
-      /* YOUR CODE HERE */
+  } else {
+    while ((num_read_bytes = read(file, buffer, stp_mss(stp_CB))) > 0) {
+      if(stp_send(stp_CB, buffer, num_read_bytes) == STP_ERROR) {
+        /* YOUR CODE HERE */
 	perror("STP_ERROR on send");
 	exit(1);
+      }
     }
+    free(buffer);
   }
   
-  
-  close(file);
   /* Close the connection to remote receiver */   
-  if (stp_close(stp_CB) == STP_ERROR) {
+  ret = stp_close_stats(stp_CB, &stats);
+  printStats(&stats);
+  if (ret == STP_ERROR) {
     /* YOUR CODE HERE */
 	perror("STP_CLOSE error (Receiver is already closed)");
 	exit(1);
   }
   
+  /* Only now is nothing left in the send queue that points into it */
+  if (SenderMapInput)
+    munmap(map, st.st_size);
+  close(file);
+  
   return 0;
 }
 
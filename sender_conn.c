@@ -0,0 +1,1457 @@
+/*
+ * The STP sender: one connection, from the SYN to the FIN.
+ *
+ * Nothing in here waits. stp_connect() sends the SYN and returns, and
+ * from then on the connection only moves when stp_process() is called,
+ * which reads the ACKs that have arrived and runs the retransmission
+ * timers that are due. stp_write() cuts what the window and pacing
+ * let through into segments, and stp_shutdown() sends the FIN once
+ * the send queue is empty. An application with an event loop of its
+ * own watches stp_fd() and wakes up after stp_timeout(), and needs no
+ * thread per connection (see libstp.h).
+ *
+ * A failed connection records why in stp_CB->error, an STP_ERR_ code,
+ * and tells the receiver with a RESET if it was us who gave up;
+ * nothing here exits the process.
+ *
+ * stp_open(), stp_send() and stp_close() block, for SendApp: they
+ * make the same calls and wait on the connection's own event loop
+ * (see stp.c) in between.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "stp.h"
+#include "libstp.h"
+
+#define PKT_SIZE 4096
+
+//Sender states
+#define STP_SYN_SENT   0x24
+#define STP_CLOSING   0x25	/* FIN sent, waiting for it to be ACKed */
+
+/*
+ * The settings a connection gets when its caller passes none, and
+ * that stp_config_defaults() starts a configuration from.
+ */
+static const stp_sender_config defaultConfig = {
+	5000,                   /* maxWin */
+	50,                     /* rtoMinMs */
+	60000,                  /* rtoMaxMs */
+	8,                      /* maxRetries */
+	0,                      /* zeroCopy */
+	STP_DEFAULT_MAX_MTU,    /* maxMtu */
+	0,                      /* pathMtu */
+	STP_VERSION_2,          /* maxVersion */
+	1,                      /* crc32c */
+	"cubic",                /* congestion */
+	0,                      /* maxRate */
+	0,                      /* txTime */
+	1,                      /* segmentCopy */
+};
+
+/*
+ * Pacing: new segments leave at gain * cwnd / SRTT, faster in slow
+ * start so that cwnd can still double every round trip. A segment
+ * may go up to PACE_SLACK_US ahead of its slot, which lets one wakeup
+ * of the millisecond timers release a millisecond's worth.
+ */
+#define PACE_GAIN_SS 2.0
+#define PACE_GAIN_CA 1.2
+#define PACE_SLACK_US 1000
+
+#define DUPACK_THRESHOLD 3      /* duplicate ACKs that signal a loss */
+
+#define RTO_INITIAL 1000        /* RTO before the first RTT sample (RFC 6298) */
+
+
+struct stp_send_ctrl_blk_tag {
+
+	int state;	 /* protocol state: normally ESTABLISHED */
+	int sock; 	/* UDP socket descriptor */
+
+	unsigned int swnd;         // latest advertised sender window size
+	unsigned int NBE;          // next byte expected - next ACK seq Num expected
+	unsigned int NextSeqNum;   // seqno of the next new byte to be sent
+	unsigned int SendBase;     // oldest unacknowledged byte (cumulative ACK)
+	unsigned int LBSent; 	// last byte Sent not ACKed
+
+	unsigned int numBytesInFlight; // NextSeqNum - SendBase
+	unsigned int ISN;          /* initial sequence number */
+	int mss;                   // negotiated maximum segment size
+	int version;               // negotiated wire version
+	int cksum;                 // negotiated checksum algorithm (v2)
+	int sndWscale;             // shift to apply to the receiver's window
+	int maxWin;                // cfg.maxWin, bounded by what the version allows
+	stp_sender_config cfg;     // settings of this connection, from stp_connect()
+	const stp_cc_ops *ccOps;   // cfg.congestion
+
+	char synOpts[STP_MAX_OPTIONS]; // options of our SYN, resent with it
+	int synOptsLen;
+	stp_timer ctrlTimer;       // retransmits the SYN or the FIN
+	int ctrlRetries;           // times the SYN or FIN was retransmitted
+	int timeouts;              // timeouts of the oldest segment since SendBase last moved
+	long long ackedAt;         // when SendBase last moved (ms)
+
+	stp_loop loop;             // the socket and the per-segment retransmission timers
+	int error;                 // STP_ERR_ code the connection failed with, 0 if none
+	int sockError;             // errno of the socket call that failed, 0 if none
+	int closing;               // stp_shutdown() was called
+
+	int srtt;                  // smoothed round trip time (ms), -1 until sampled
+	int rttvar;                // round trip time variation (ms)
+	int rto;                   // current retransmission timeout (ms)
+
+	stp_cc cc;                 // congestion control state, cwnd
+	unsigned int recover;      // NextSeqNum when cwnd was last cut
+	int dupAcks;               // duplicate ACKs in a row for SendBase
+	int inRecovery;            // in fast recovery until recover is ACKed
+	unsigned int inflate;      // cwnd inflation from dupACKs during recovery
+	long long paceNext;        // departure time (us) of the next new segment
+	int paced;                 // the latest write stopped to wait for paceNext
+
+	pktbuf *sendQueue;         /* Pointer to the first node of the send queue */
+	pktbuf *sendQueueTail;     /* Last node, new segments are appended here */
+	stp_pktpool sendPool;      /* buffers for the segments in the send queue */
+	stp_batch batch;           /* segments waiting for the next sendmmsg() */
+	unsigned long segsSent;    /* segments put on the wire, retransmissions included */
+	unsigned long segsRetrans; /* of those, retransmissions */
+
+};
+
+/*
+ * The connection failed with "error", an STP_ERR_ code; errno is kept
+ * if a socket call was to blame. Every timer is stopped and, unless
+ * the receiver is the one that reset, it gets a RESET.
+ */
+static void fail(stp_send_ctrl_blk *stp_CB, int error)
+{
+	pktbuf *seg;
+
+	if (stp_CB->error != 0)
+		return;
+	if (error == STP_ERR_SOCKET)
+		stp_CB->sockError = errno;
+	stp_CB->error = error;
+	stp_CB->state = STP_CLOSED;
+
+	for (seg = stp_CB->sendQueue; seg != NULL; seg = seg->next)
+		stp_timer_cancel(&stp_CB->loop.timers, &seg->timer);
+	stp_timer_cancel(&stp_CB->loop.timers, &stp_CB->ctrlTimer);
+
+	if (error == STP_ERR_TIMEOUT)
+	{
+		stp_log(STP_LOG_ERROR, "protocol error encountered... resetting connection\n");
+		sendpkt(stp_CB->sock, STP_RESET, 0, 0, 0, 0);
+	}
+}
+
+/*
+ * The error of a failed connection, with errno set again if it was
+ * a socket call that failed.
+ */
+static int failed(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_CB->sockError != 0)
+		errno = stp_CB->sockError;
+	return stp_CB->error;
+}
+
+/*
+ * Send whatever is batched. Returns 0, or -1 if the socket failed,
+ * which fails the connection.
+ */
+static int flushBatch(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_batch_flush(&stp_CB->batch) < 0)
+	{
+		fail(stp_CB, STP_ERR_SOCKET);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Feed one RTT measurement (ms) into the Jacobson/Karels estimator
+ * and recompute the RTO, which also clears any backoff.
+ */
+static void rttSample(stp_send_ctrl_blk *stp_CB, int rtt)
+{
+	int rto;
+
+	if (rtt < 0)
+		return;
+
+	if (stp_CB->srtt < 0)
+	{
+		stp_CB->srtt = rtt;
+		stp_CB->rttvar = rtt / 2;
+	}
+	else
+	{
+		int delta = stp_CB->srtt - rtt;
+		if (delta < 0)
+			delta = -delta;
+		stp_CB->rttvar = (3 * stp_CB->rttvar + delta) / 4;
+		stp_CB->srtt = (7 * stp_CB->srtt + rtt) / 8;
+	}
+
+	rto = stp_CB->srtt + (4 * stp_CB->rttvar > STP_TIMER_TICK_MS ?
+			      4 * stp_CB->rttvar : STP_TIMER_TICK_MS);
+	if (rto < stp_CB->cfg.rtoMinMs)
+		rto = stp_CB->cfg.rtoMinMs;
+	if (rto > stp_CB->cfg.rtoMaxMs)
+		rto = stp_CB->cfg.rtoMaxMs;
+	stp_CB->rto = rto;
+}
+
+//Exponential backoff after a timeout, bounded by cfg.rtoMaxMs
+static void backoffRto(stp_send_ctrl_blk *stp_CB)
+{
+	int max = stp_CB->cfg.rtoMaxMs;
+
+	stp_CB->rto = 2 * stp_CB->rto > max ? max : 2 * stp_CB->rto;
+}
+
+/*
+ * Timeout of one segment: the RTO backed off once for every time this
+ * segment has already been retransmitted. Backing off per segment
+ * keeps a stalled window from inflating the RTO once per segment.
+ */
+static int segmentRto(stp_send_ctrl_blk *stp_CB, pktbuf *seg)
+{
+	long long rto = (long long)stp_CB->rto << (seg->retries < 16 ? seg->retries : 16);
+
+	return rto > stp_CB->cfg.rtoMaxMs ? stp_CB->cfg.rtoMaxMs : (int)rto;
+}
+
+/*
+ * Take an RTT sample from the timestamp echoed in an ACK. Because the
+ * echo names the transmission the receiver actually saw, this is also
+ * valid for retransmitted segments. Returns 0 if the ACK carried no
+ * echo, in which case the caller has to fall back to Karn's rule.
+ */
+static int rttSampleFromEcho(stp_send_ctrl_blk *stp_CB, stp_pkt *p)
+{
+	if (p->tsecr == 0)
+		return 0;
+	rttSample(stp_CB, (int)(stp_timestamp() - p->tsecr));
+	return 1;
+}
+
+/*
+ * Whether a socket error only means that the ACK of our FIN was lost:
+ * the FIN went out after all the data had been acknowledged, and a
+ * receiver that has seen it closes its port, so the FIN we send again
+ * is refused. The connection is closed then.
+ */
+static int finAckLost(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_CB->state != STP_CLOSING || errno != ECONNREFUSED)
+		return 0;
+	stp_log(STP_LOG_INFO, "Receiver closed before our FIN was ACKed\n");
+	stp_timer_cancel(&stp_CB->loop.timers, &stp_CB->ctrlTimer);
+	stp_CB->state = STP_CLOSED;
+	return 1;
+}
+
+/*
+ * Sends (or resends) the SYN or the FIN, whichever the state calls
+ * for, and arms the timer that sends it again. The SYN always goes
+ * out as v1, so that any receiver understands it, and carries our
+ * options; the FIN uses the version we agreed on.
+ */
+static void sendControl(stp_send_ctrl_blk *stp_CB)
+{
+	stp_pkt p;
+
+	memset(&p, 0, sizeof(p));
+	p.cksum = stp_CB->cksum;
+	if (stp_CB->state == STP_SYN_SENT)
+	{
+		p.version = STP_VERSION_1;
+		p.type = STP_SYN;
+		p.seqno = stp_CB->ISN;
+		p.opts = stp_CB->synOpts;
+		p.optsLen = stp_CB->synOptsLen;
+	}
+	else
+	{
+		p.version = stp_CB->version;
+		p.type = STP_FIN;
+		p.seqno = stp_CB->NextSeqNum;
+	}
+	if (stp_sendpkt(stp_CB->sock, &p, 0) < 0)
+	{
+		if (!finAckLost(stp_CB))
+			fail(stp_CB, STP_ERR_SOCKET);
+		return;
+	}
+	stp_timer_arm(&stp_CB->loop.timers, &stp_CB->ctrlTimer, stp_now_ms() + stp_CB->rto);
+}
+
+/*
+ * Timer callback of the SYN or FIN: no ACK for it within the RTO.
+ */
+static void controlTimedOut(stp_timer *t, void *arg)
+{
+	stp_send_ctrl_blk *stp_CB = (stp_send_ctrl_blk *) arg;
+
+	stp_log(STP_LOG_INFO, "Sorry timed out...\n ");
+	if (++stp_CB->ctrlRetries == stp_CB->cfg.maxRetries)
+	{
+		fail(stp_CB, STP_ERR_TIMEOUT);
+		return;
+	}
+	backoffRto(stp_CB);
+	sendControl(stp_CB);
+}
+
+/*
+ * Queues one buffered segment for the wire. It is actually sent with
+ * the rest of the batch, at the latest when we start waiting for ACKs,
+ * but with SO_TXTIME the kernel holds it until departUs (0 for now).
+ * If neither the batch nor the socket has room the segment is marked
+ * unsent and its timer tries it again on the next tick, without
+ * counting that as a timeout.
+ */
+static void sendSegment(stp_send_ctrl_blk *stp_CB, pktbuf *seg, long long departUs)
+{
+	stp_pkt p;
+
+	memset(&p, 0, sizeof(p));
+	p.version = stp_CB->version;
+	p.cksum = stp_CB->cksum;
+	p.type = STP_DATA;
+	p.window = stp_CB->swnd > 0xffff ? 0xffff : stp_CB->swnd;
+	p.seqno = seg->seqno;
+	p.data = seg->payload;
+	p.len = seg->len;
+
+	seg->sentAt = stp_now_ms();
+	seg->unsent = stp_batch_add(&stp_CB->batch, &p, departUs) < 0;
+	if (seg->unsent)
+	{
+		stp_timer_arm(&stp_CB->loop.timers, &seg->timer, seg->sentAt + STP_TIMER_TICK_MS);
+		return;
+	}
+	stp_CB->segsSent++;
+	if (seg->retries > 0)
+		stp_CB->segsRetrans++;
+	stp_timer_arm(&stp_CB->loop.timers, &seg->timer, seg->sentAt + segmentRto(stp_CB, seg));
+}
+
+/*
+ * Retransmission timer callback of a segment. The segment is sent
+ * again with its timeout backed off.
+ *
+ * As with TCP's single timer (RFC 6298, 5.3), an ACK that moves
+ * SendBase restarts the clock: a segment sent before the latest such
+ * ACK gets its full RTO from that ACK before it counts as lost, so
+ * that one loss does not time out the whole window behind it. Only
+ * the timeouts of the oldest segment count towards giving up, and
+ * the count starts again whenever SendBase moves.
+ */
+static void segmentTimedOut(stp_timer *t, void *arg)
+{
+	stp_send_ctrl_blk *stp_CB = (stp_send_ctrl_blk *) arg;
+	pktbuf *seg = (pktbuf *)((char *)t - offsetof(pktbuf, timer));
+	long long now = stp_now_ms();
+
+	/* Not on the wire yet: not lost either */
+	if (seg->unsent)
+	{
+		sendSegment(stp_CB, seg, 0);
+		return;
+	}
+
+	if (stp_CB->ackedAt > seg->sentAt &&
+	    stp_CB->ackedAt + segmentRto(stp_CB, seg) > now)
+	{
+		stp_timer_arm(&stp_CB->loop.timers, &seg->timer,
+			      stp_CB->ackedAt + segmentRto(stp_CB, seg));
+		return;
+	}
+
+	stp_log(STP_LOG_DEBUG, "Sorry timed out... (seq %u)\n", seg->seqno);
+	if (seg == stp_CB->sendQueue && ++stp_CB->timeouts == stp_CB->cfg.maxRetries)
+	{
+		fail(stp_CB, STP_ERR_TIMEOUT);
+		return;
+	}
+	seg->retries++;
+
+	/*
+	 * The other timers of the same window do not cut cwnd again. A
+	 * timeout during fast recovery means that recovery failed.
+	 */
+	if (stp_CB->inRecovery || !greater(stp_CB->recover, seg->seqno))
+	{
+		stp_CB->cc.ops->on_timeout(&stp_CB->cc, stp_CB->numBytesInFlight, stp_now_ms());
+		stp_CB->recover = stp_CB->NextSeqNum;
+		stp_CB->inRecovery = 0;
+		stp_CB->inflate = 0;
+	}
+	stp_CB->dupAcks = 0;
+	sendSegment(stp_CB, seg, 0);
+}
+
+/*
+ * Release every segment covered by the cumulative ACK ackno from the
+ * send queue and move SendBase forward.
+ */
+static void ackNewData(stp_send_ctrl_blk *stp_CB, stp_pkt *p,
+		       unsigned int ackno)
+{
+	/* Karn's rule: without an echo only never-retransmitted segments count */
+	if (!rttSampleFromEcho(stp_CB, p) &&
+	    stp_CB->sendQueue != NULL && stp_CB->sendQueue->retries == 0)
+		rttSample(stp_CB, (int)(stp_now_ms() - stp_CB->sendQueue->sentAt));
+
+	/* cwnd does not grow while fast recovery repairs the window */
+	if (!stp_CB->inRecovery)
+		stp_cc_ack(&stp_CB->cc, minus(ackno, stp_CB->SendBase), stp_CB->numBytesInFlight,
+			   stp_CB->srtt, stp_now_ms());
+
+	while (stp_CB->sendQueue != NULL &&
+	       !greater(plus(stp_CB->sendQueue->seqno, stp_CB->sendQueue->len), ackno))
+	{
+		pktbuf *acked = stp_CB->sendQueue;
+		stp_CB->sendQueue = acked->next;
+		stp_timer_cancel(&stp_CB->loop.timers, &acked->timer);
+		stp_pool_put(&stp_CB->sendPool, acked);
+	}
+	if (stp_CB->sendQueue == NULL)
+		stp_CB->sendQueueTail = NULL;
+
+	stp_CB->SendBase = ackno;
+	stp_CB->NBE = ackno;
+	stp_CB->ackedAt = stp_now_ms();
+	stp_CB->timeouts = 0;
+	stp_CB->numBytesInFlight = minus(stp_CB->NextSeqNum, stp_CB->SendBase);
+}
+
+/*
+ * Update the scoreboard from the SACK blocks carried in an ACK. A
+ * segment that lies entirely inside a block has been buffered by the
+ * receiver: it is marked and its retransmission timer is stopped, so
+ * that only the holes between the blocks are ever sent again.
+ */
+static void processSack(stp_send_ctrl_blk *stp_CB, stp_sack_block *blocks, int nblocks)
+{
+	pktbuf *seg;
+	int i;
+
+	for (i = 0; i < nblocks; i++)
+	{
+		unsigned int start = blocks[i].start;
+		unsigned int end = blocks[i].end;
+
+		for (seg = stp_CB->sendQueue; seg != NULL; seg = seg->next)
+		{
+			if (greater(start, seg->seqno))
+				continue;
+			if (greater(plus(seg->seqno, seg->len), end))
+				break;
+			if (!seg->sacked)
+			{
+				seg->sacked = 1;
+				stp_timer_cancel(&stp_CB->loop.timers, &seg->timer);
+			}
+		}
+	}
+}
+
+/*
+ * Retransmit the oldest segment the receiver has not SACKed, right
+ * away instead of waiting for its timer. It counts as retransmitted,
+ * as after a timeout, so Karn's rule takes no RTT sample from it and
+ * its timer backs off from the right count.
+ */
+static void fastRetransmit(stp_send_ctrl_blk *stp_CB)
+{
+	pktbuf *seg;
+
+	for (seg = stp_CB->sendQueue; seg != NULL && seg->sacked; seg = seg->next)
+		;
+	if (seg == NULL)
+		return;
+	stp_log(STP_LOG_DEBUG, "Fast retransmit (seq %u)\n", seg->seqno);
+	seg->retries++;
+	sendSegment(stp_CB, seg, 0);
+}
+
+/*
+ * The oldest unacknowledged segment counts as lost once the receiver
+ * has SACKed DUPACK_THRESHOLD segments beyond it (as in RFC 6675).
+ * This stands in for duplicate ACKs when the receiver acknowledges a
+ * whole batch of arrivals with one ACK.
+ */
+static int lostBySack(stp_send_ctrl_blk *stp_CB)
+{
+	pktbuf *seg = stp_CB->sendQueue;
+	int n = 0;
+
+	if (seg == NULL || seg->sacked)
+		return 0;
+	for (seg = seg->next; seg != NULL && n < DUPACK_THRESHOLD; seg = seg->next)
+		if (seg->sacked)
+			n++;
+	return n == DUPACK_THRESHOLD;
+}
+
+/*
+ * A loss was detected: cut cwnd once for this window and retransmit
+ * the missing segment.
+ */
+static void enterRecovery(stp_send_ctrl_blk *stp_CB)
+{
+	stp_CB->cc.ops->on_loss(&stp_CB->cc, stp_CB->numBytesInFlight, stp_now_ms());
+	stp_CB->recover = stp_CB->NextSeqNum;
+	stp_CB->inRecovery = 1;
+	stp_CB->inflate = DUPACK_THRESHOLD * stp_CB->mss;
+	stp_CB->dupAcks = 0;
+	fastRetransmit(stp_CB);
+}
+
+/*
+ * Fast retransmit and fast recovery (NewReno, RFC 6582) for an ACK
+ * that either acknowledged "acked" new bytes or, if acked is 0, was a
+ * duplicate. The third duplicate in a row, or enough SACKed data
+ * beyond the oldest segment, retransmits the missing segment and
+ * enters recovery. During recovery every further duplicate inflates
+ * cwnd by a segment, since each one means a segment has left the
+ * network. A partial ACK retransmits the next hole; the ACK for
+ * everything that was outstanding ends recovery.
+ */
+static void fastRecovery(stp_send_ctrl_blk *stp_CB, unsigned int acked)
+{
+	if (stp_CB->inRecovery)
+	{
+		if (acked == 0)
+			stp_CB->inflate += stp_CB->mss;
+		else if (!greater(stp_CB->recover, stp_CB->SendBase))
+		{
+			stp_CB->inRecovery = 0;
+			stp_CB->inflate = 0;
+		}
+		else
+		{
+			stp_CB->inflate = stp_CB->inflate > acked ? stp_CB->inflate - acked : 0;
+			stp_CB->inflate += stp_CB->mss;
+			fastRetransmit(stp_CB);
+		}
+		return;
+	}
+
+	if (acked > 0)
+		stp_CB->dupAcks = 0;
+	else if (stp_CB->sendQueue != NULL)
+		stp_CB->dupAcks++;
+
+	/* After a timeout, duplicates from the old window are expected */
+	if ((stp_CB->dupAcks >= DUPACK_THRESHOLD || lostBySack(stp_CB)) &&
+	    greater(stp_CB->SendBase, stp_CB->recover - 1))
+		enterRecovery(stp_CB);
+}
+
+/*
+ * Process an ACK for the data path. A cumulative ACK that covers new
+ * data releases it; SACK blocks, which may also ride on duplicate
+ * ACKs, update the scoreboard; duplicates drive fast retransmit.
+ * Corrupted or stale ACKs are ignored.
+ */
+static void processAck(stp_send_ctrl_blk *stp_CB, char *pkt, int len)
+{
+	stp_pkt p;
+	unsigned int ackno, acked = 0, oldWnd;
+
+	if (stp_decode(&p, pkt, len, stp_CB->SendBase) < 0)
+	{
+		stp_log(STP_LOG_WARN, "ACK was corrupted. Ignoring\n");
+		return;
+	}
+	if (p.type != STP_ACK)
+	{
+		if (p.type == STP_RESET)
+			fail(stp_CB, STP_ERR_RESET);
+		return;
+	}
+
+	ackno = p.seqno;
+	oldWnd = stp_CB->swnd;
+	stp_CB->swnd = p.window << stp_CB->sndWscale;
+
+	/* Only ACKs in (SendBase, NextSeqNum] acknowledge new data */
+	if (greater(ackno, stp_CB->SendBase) && !greater(ackno, stp_CB->NextSeqNum))
+	{
+		acked = minus(ackno, stp_CB->SendBase);
+		ackNewData(stp_CB, &p, ackno);
+	}
+	else if (ackno != stp_CB->SendBase)
+		return;
+
+	if (p.optsLen > 0)
+	{
+		stp_sack_block blocks[STP_MAX_SACK_BLOCKS];
+		int n = stp_get_sack(p.opts, p.optsLen, p.version, stp_CB->SendBase,
+				     blocks, STP_MAX_SACK_BLOCKS);
+		if (n > 0)
+			processSack(stp_CB, blocks, n);
+	}
+
+	/* A window update is not a duplicate (RFC 5681) */
+	if (acked == 0 && stp_CB->swnd != oldWnd)
+		return;
+
+	fastRecovery(stp_CB, acked);
+}
+
+/*
+ * The SYN-ACK p has arrived: take what the receiver agreed to, and
+ * set up for sending data.
+ */
+static void established(stp_send_ctrl_blk *stp_CB, stp_pkt *p)
+{
+	unsigned short offer, agreed;
+	unsigned char wscale, cksum;
+
+	stp_log(STP_LOG_DEBUG, "Received packet back\n");
+	stp_CB->state = STP_ESTABLISHED;
+
+	/*
+	 * The SYN-ACK comes in the version the receiver picked. Only a v2
+	 * receiver scales its window, and only a v2 connection can have
+	 * more than 32K of sequence space in flight.
+	 */
+	stp_CB->version = p->version;
+	if (stp_CB->version >= STP_VERSION_2)
+	{
+		if (stp_get_option(p->opts, p->optsLen, STP_OPT_WSCALE, &wscale, sizeof(wscale)) == sizeof(wscale) &&
+		    wscale <= STP_MAX_WSCALE)
+			stp_CB->sndWscale = wscale;
+		if (stp_CB->cfg.crc32c &&
+		    stp_get_option(p->opts, p->optsLen, STP_OPT_CKSUM, &cksum, sizeof(cksum)) == sizeof(cksum) &&
+		    cksum == STP_CKSUM_CRC32C)
+			stp_CB->cksum = STP_CKSUM_CRC32C;
+	}
+	else if (stp_CB->maxWin > STP_MAX_WIN_V1)
+		stp_CB->maxWin = STP_MAX_WIN_V1;
+
+	stp_CB->NextSeqNum = p->seqno;
+	stp_CB->SendBase = p->seqno;
+	stp_CB->NBE = p->seqno;
+	stp_CB->swnd = p->window << stp_CB->sndWscale;
+
+	/* A receiver that does not negotiate gets the classic MSS */
+	stp_get_option(stp_CB->synOpts, stp_CB->synOptsLen, STP_OPT_MSS, &offer, sizeof(offer));
+	if (stp_get_option(p->opts, p->optsLen,
+			   STP_OPT_MSS, &agreed, sizeof(agreed)) == sizeof(agreed) &&
+	    ntohs(agreed) <= ntohs(offer))
+		stp_CB->mss = ntohs(agreed);
+	else
+		stp_CB->mss = STP_MSS;
+	if (stp_CB->mss < STP_MIN_MSS)
+		stp_CB->mss = STP_MIN_MSS;
+	stp_log(STP_LOG_INFO, "version %d MSS %d window %d scale %d checksum %s\n", stp_CB->version,
+	       stp_CB->mss, stp_CB->maxWin, stp_CB->sndWscale,
+	       stp_CB->cksum == STP_CKSUM_CRC32C ? stp_crc32c_impl() : "sum");
+
+	stp_cc_init(&stp_CB->cc, stp_CB->ccOps, stp_CB->mss, stp_CB->maxWin);
+	stp_CB->recover = stp_CB->NextSeqNum;
+	stp_CB->dupAcks = 0;
+	stp_CB->inRecovery = 0;
+	stp_CB->inflate = 0;
+
+	/* Segments of a mapped file need no room for their payload */
+	if (stp_pool_init(&stp_CB->sendPool, stp_CB->maxWin / stp_CB->mss + 2,
+			  stp_CB->cfg.segmentCopy ? stp_CB->mss : 0) < 0)
+		fail(stp_CB, STP_ERR_NOMEM);
+}
+
+/*
+ * Process the answer to our SYN or FIN. A corrupted one gets the SYN
+ * or FIN sent again; while the FIN is out, late ACKs for data are
+ * ignored.
+ */
+static void processControlAck(stp_send_ctrl_blk *stp_CB, char *pkt, int len)
+{
+	unsigned int seqNum = stp_CB->state == STP_SYN_SENT ? stp_CB->ISN : stp_CB->NextSeqNum;
+	stp_pkt p;
+
+	if (stp_decode(&p, pkt, len, seqNum) < 0)
+	{
+		stp_log(STP_LOG_WARN, "ACK was corrupted. Retransmit\n");
+		sendControl(stp_CB);
+		return;
+	}
+	if (p.type == STP_RESET)
+	{
+		fail(stp_CB, STP_ERR_RESET);
+		return;
+	}
+	if (stp_CB->state == STP_CLOSING && p.seqno != plus(seqNum, 1))
+		return;
+
+	rttSampleFromEcho(stp_CB, &p);
+	stp_timer_cancel(&stp_CB->loop.timers, &stp_CB->ctrlTimer);
+	if (stp_CB->state == STP_SYN_SENT)
+		established(stp_CB, &p);
+	else
+	{
+		stp_CB->state = STP_CLOSED;
+		stp_log(STP_LOG_INFO, "Connection Closed\n");
+	}
+}
+
+/*
+ * Loop handler of the socket: process every packet that has arrived.
+ */
+static void readAcks(int fd, void *arg)
+{
+	stp_send_ctrl_blk *stp_CB = (stp_send_ctrl_blk *) arg;
+	char pkt[PKT_SIZE];
+	int readTemp;
+
+	while ((readTemp = readpkt(fd, pkt, PKT_SIZE)) >= 0)
+	{
+		if (stp_CB->state == STP_ESTABLISHED)
+			processAck(stp_CB, pkt, readTemp);
+		else if (stp_CB->state == STP_SYN_SENT || stp_CB->state == STP_CLOSING)
+			processControlAck(stp_CB, pkt, readTemp);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !finAckLost(stp_CB))
+		fail(stp_CB, STP_ERR_SOCKET);
+}
+
+/*
+ * After stp_shutdown(), the FIN goes out as soon as every segment has
+ * been acknowledged.
+ */
+static void sendFin(stp_send_ctrl_blk *stp_CB)
+{
+	if (!stp_CB->closing || stp_CB->state != STP_ESTABLISHED || stp_CB->sendQueue != NULL)
+		return;
+	stp_CB->state = STP_CLOSING;
+	stp_CB->ctrlRetries = 0;
+	sendControl(stp_CB);
+}
+
+/*
+ * Usable window: the smaller of what the receiver advertised and the
+ * congestion window, capped by our own maximum, minus what is
+ * already in flight. An empty pipe may always carry one segment so
+ * that a zero window can never deadlock us.
+ */
+static int windowAllows(stp_send_ctrl_blk *stp_CB, int len)
+{
+	unsigned int wnd = stp_CB->swnd < stp_CB->maxWin ? stp_CB->swnd : stp_CB->maxWin;
+	unsigned long long cwnd = (unsigned long long) stp_CB->cc.cwnd + stp_CB->inflate;
+
+	if (cwnd < wnd)
+		wnd = (unsigned int) cwnd;
+
+	if (stp_CB->numBytesInFlight == 0)
+		return 1;
+	return stp_CB->numBytesInFlight + len <= wnd;
+}
+
+/*
+ * Pacing rate in bytes per microsecond, or 0 if new segments need not
+ * be paced. Until there is an RTT sample only the -p cap applies.
+ */
+static double paceRate(stp_send_ctrl_blk *stp_CB)
+{
+	double rate = 0;
+
+	if (stp_CB->srtt >= 0)
+	{
+		double gain = stp_CB->cc.cwnd < stp_CB->cc.ssthresh ? PACE_GAIN_SS : PACE_GAIN_CA;
+		int srtt = stp_CB->srtt > 0 ? stp_CB->srtt : STP_TIMER_TICK_MS;
+
+		rate = gain * stp_CB->cc.cwnd / (srtt * 1000.0);
+	}
+	if (stp_CB->cfg.maxRate > 0 && (rate == 0 || rate > stp_CB->cfg.maxRate))
+		rate = stp_CB->cfg.maxRate;
+	return rate;
+}
+
+/*
+ * Microseconds until the next new segment may leave, 0 if it may go
+ * now. Time that passed unused does not build up credit.
+ */
+static long long paceDelay(stp_send_ctrl_blk *stp_CB, long long now)
+{
+	if (paceRate(stp_CB) == 0)
+		return 0;
+	if (stp_CB->paceNext < now)
+		stp_CB->paceNext = now;
+	return stp_CB->paceNext > now + PACE_SLACK_US ? stp_CB->paceNext - PACE_SLACK_US - now : 0;
+}
+
+/*
+ * Cut as much of the data into segments and queue them as may go
+ * now, copying the payload into the segment buffers if "copy" is set.
+ * Returns the number of bytes queued, which falls short of length
+ * once the window is full, the buffers have run out or the next
+ * segment has to wait for its pacing slot.
+ */
+static int queueData(stp_send_ctrl_blk *stp_CB, const unsigned char *data, int length, int copy)
+{
+	int queued = 0;
+
+	stp_CB->paced = 0;
+	while (queued < length)
+	{
+		int segLen = length - queued < stp_CB->mss ? length - queued : stp_CB->mss;
+		pktbuf *seg;
+
+		long long depart;
+		double rate;
+
+		/* Running out of buffers, or socket buffer, is just another way of the window being full */
+		if (!windowAllows(stp_CB, segLen) || stp_pool_empty(&stp_CB->sendPool) ||
+		    stp_CB->batch.full)
+			break;
+		if (paceDelay(stp_CB, stp_now_us()) > 0)
+		{
+			stp_CB->paced = 1;
+			break;
+		}
+
+		seg = stp_pool_get(&stp_CB->sendPool);
+		seg->seqno = stp_CB->NextSeqNum;
+		seg->len = segLen;
+		seg->retries = 0;
+		seg->sacked = 0;
+		seg->unsent = 0;
+		stp_timer_init(&seg->timer, segmentTimedOut, stp_CB);
+		seg->payload = (char *) data + queued;
+		if (copy)
+		{
+			memcpy(seg->data, data + queued, segLen);
+			seg->payload = seg->data;
+		}
+
+		if (stp_CB->sendQueueTail == NULL)
+			stp_CB->sendQueue = seg;
+		else
+			stp_CB->sendQueueTail->next = seg;
+		stp_CB->sendQueueTail = seg;
+
+		/* Take the segment's slot; it leaves at the start of it */
+		depart = 0;
+		if ((rate = paceRate(stp_CB)) > 0)
+		{
+			depart = stp_CB->paceNext;
+			stp_CB->paceNext += (long long) (segLen / rate);
+		}
+
+		sendSegment(stp_CB, seg, depart);
+		stp_CB->LBSent = plus(seg->seqno, segLen - 1);
+		stp_CB->NextSeqNum = plus(stp_CB->NextSeqNum, segLen);
+		stp_CB->numBytesInFlight = minus(stp_CB->NextSeqNum, stp_CB->SendBase);
+
+		queued += segLen;
+	}
+
+	return queued;
+}
+
+/*
+ * Whether data may be written now: 0 if so, STP_WOULD_BLOCK while the
+ * SYN is out, otherwise the error to return.
+ */
+static int writable(stp_send_ctrl_blk *stp_CB, int copy)
+{
+	if (stp_CB->error != 0)
+		return failed(stp_CB);
+	if (stp_CB->state == STP_SYN_SENT)
+		return STP_WOULD_BLOCK;
+	if (stp_CB->state != STP_ESTABLISHED || stp_CB->closing)
+		return STP_ERR_STATE;
+	if (copy && stp_CB->sendPool.dataSize < stp_CB->mss)
+		return STP_ERR_STATE;
+	return 0;
+}
+
+/*
+ * Nonblocking write: queue what may go now and send it. Returns the
+ * number of bytes taken, STP_WOULD_BLOCK if that would have been none,
+ * or an error.
+ */
+static int writeData(stp_send_ctrl_blk *stp_CB, const unsigned char *data, int length, int copy)
+{
+	int n = writable(stp_CB, copy);
+
+	if (n != 0 || length <= 0)
+		return n;
+	n = queueData(stp_CB, data, length, copy);
+	if (flushBatch(stp_CB) < 0)
+		return failed(stp_CB);
+	return n > 0 ? n : STP_WOULD_BLOCK;
+}
+
+int stp_write(stp_send_ctrl_blk *stp_CB, const unsigned char *data, int length)
+{
+	return writeData(stp_CB, data, length, 1);
+}
+
+/*
+ * Like stp_write(), but the segments are sent straight from "data"
+ * rather than from a copy of it, both the first time and when they
+ * are retransmitted. The memory must stay as it is until the
+ * connection is closed; with cfg.zeroCopy the kernel may still be
+ * sending from it after that, so it may be unmapped but not changed.
+ */
+int stp_write_mapped(stp_send_ctrl_blk *stp_CB, const unsigned char *data, int length)
+{
+	return writeData(stp_CB, data, length, 0);
+}
+
+/*
+ * Read what has arrived on the socket and run the timers that are
+ * due. Returns STP_OK, or the error the connection failed with.
+ */
+int stp_process(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_CB->error == 0)
+	{
+		readAcks(stp_CB->sock, stp_CB);
+		stp_timer_expire(&stp_CB->loop.timers, stp_now_ms());
+		sendFin(stp_CB);
+		flushBatch(stp_CB);
+	}
+	return stp_CB->error != 0 ? failed(stp_CB) : STP_OK;
+}
+
+/*
+ * Milliseconds until stp_process() has to run even if nothing
+ * arrives: the earliest retransmission timer or, if the latest write
+ * was held back by pacing, the next pacing slot. Segments that the
+ * socket buffer had no room for are tried again after a timer tick.
+ * -1 if there is nothing to wait for.
+ */
+int stp_timeout(stp_send_ctrl_blk *stp_CB)
+{
+	long long now = stp_now_us();
+	int ms = stp_timer_next_ms(&stp_CB->loop.timers, now / 1000);
+
+	if (stp_CB->batch.count > 0 && stp_CB->error == 0 && (ms < 0 || ms > STP_TIMER_TICK_MS))
+		ms = STP_TIMER_TICK_MS;
+
+	if (stp_CB->paced && stp_CB->error == 0)
+	{
+		int pace = (int) ((paceDelay(stp_CB, now) + 999) / 1000);
+
+		if (ms < 0 || pace < ms)
+			ms = pace;
+	}
+	return ms;
+}
+
+int stp_fd(stp_send_ctrl_blk *stp_CB)
+{
+	return stp_CB->sock;
+}
+
+// The negotiated MSS, 0 until the connection is established
+int stp_mss(stp_send_ctrl_blk *stp_CB)
+{
+	return stp_CB->state == STP_SYN_SENT ? 0 : stp_CB->mss;
+}
+
+/*
+ * Close the connection: no more writes, and the FIN goes out once
+ * everything written has been acknowledged. Returns STP_OK when the
+ * FIN has been acknowledged too, STP_WOULD_BLOCK until then, or an
+ * error.
+ */
+int stp_shutdown(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_CB->error != 0)
+		return failed(stp_CB);
+	stp_CB->closing = 1;
+	sendFin(stp_CB);
+	if (stp_CB->error != 0)
+		return failed(stp_CB);
+	return stp_CB->state == STP_CLOSED ? STP_OK : STP_WOULD_BLOCK;
+}
+
+/*
+ * Release everything the control block owns, and the block itself,
+ * in whatever state the connection is.
+ */
+void stp_free(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_CB->sendPool.slab != NULL)
+		stp_pool_destroy(&stp_CB->sendPool);
+	stp_loop_del(&stp_CB->loop, stp_CB->sock);
+	stp_loop_destroy(&stp_CB->loop);
+	close(stp_CB->sock);
+	free(stp_CB);
+}
+
+/*
+ * The counters of the connection so far. The congestion control and
+ * buffer figures only exist once it is established; until then
+ * stats->cc is NULL and they are 0.
+ */
+void stp_stats(stp_send_ctrl_blk *stp_CB, stp_sender_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->segsSent = stp_CB->segsSent;
+	stats->segsRetrans = stp_CB->segsRetrans;
+	if (stp_CB->sendPool.slab == NULL)
+		return;
+
+	stats->cc = stp_CB->cc.ops->name;
+	stats->cwnd = stp_CB->cc.cwnd;
+	stats->ssthresh = stp_cc_ssthresh(&stp_CB->cc);
+	stats->losses = stp_CB->cc.losses;
+	stats->timeouts = stp_CB->cc.timeouts;
+	stats->poolBuffers = stp_CB->sendPool.capacity;
+	stats->poolBufferSize = stp_CB->sendPool.stride;
+	stats->poolHighWater = stp_CB->sendPool.highWater;
+	stats->poolAllocs = stp_CB->sendPool.allocs;
+	stats->poolFailures = stp_CB->sendPool.failures;
+}
+
+const char *stp_strerror(int error)
+{
+	switch (error)
+	{
+	case STP_OK:          return "success";
+	case STP_WOULD_BLOCK: return "operation would block";
+	case STP_ERR_RESET:   return "connection reset by the receiver";
+	case STP_ERR_TIMEOUT: return "the receiver stopped answering";
+	case STP_ERR_SOCKET:  return "a socket call failed";
+	case STP_ERR_NOMEM:   return "out of memory";
+	case STP_ERR_ADDRESS: return "no such destination";
+	case STP_ERR_STATE:   return "not possible in this state of the connection";
+	case STP_ERR_CONFIG:  return "invalid configuration";
+	default:              return "unknown error";
+	}
+}
+
+/*
+ * Why stp_CB failed, with the errno of the socket call to blame as it
+ * was when the call failed; "success" if it has not.
+ */
+const char *stp_conn_strerror(stp_send_ctrl_blk *stp_CB)
+{
+	if (stp_CB->error == STP_ERR_SOCKET && stp_CB->sockError != 0)
+		return strerror(stp_CB->sockError);
+	return stp_strerror(stp_CB->error);
+}
+
+//Creates UDP sockets
+static int open_udp(char *destination, int destinationPort,int receivePort)
+{
+	int      fd;
+	uint32_t dst;
+	struct   sockaddr_in sin;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+
+	/* Bind the local socket to listen at the local_port. */
+	stp_log(STP_LOG_INFO, "Binding locally to port %d\n", receivePort);
+	memset((char *)&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(receivePort);
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+	{
+		int saved = errno;
+
+		close(fd);
+		errno = saved;
+		return -2;
+	}
+
+	dst = hostname_to_ipaddr(destination);
+
+	if (!dst) {
+		stp_log(STP_LOG_ERROR, "Invalid sending host name: %s\n", destination);
+		close(fd);
+		return -4;
+	}
+	stp_log(STP_LOG_INFO, "Configuring  UDP \"connection\" to <%u.%u.%u.%u, port %d>\n",
+          (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF,
+          (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF, destinationPort);
+
+	memset((char *)&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(destinationPort);
+	sin.sin_addr.s_addr = dst;
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+	{
+		int saved = errno;
+
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+	stp_log(STP_LOG_INFO, "UDP \"connection\" to <%u.%u.%u.%u port %d> configured\n",
+          (ntohl(dst)>>24) & 0xFF, (ntohl(dst)>>16) & 0xFF,
+          (ntohl(dst)>>8) & 0XFF, ntohl(dst) & 0XFF , destinationPort);
+
+
+	return fd;
+}
+
+/*
+ * A pseudo random initial sequence number, never zero, that fits the
+ * 16 bits of the v1 SYN. It comes from a generator of the connection's
+ * own, so the application's rand() stream is left alone; the seed
+ * mixes the time in us with the process and the local port, so that
+ * connections opened at the same moment still start apart.
+ */
+static unsigned int initialSeqNum(int receivePort)
+{
+	long long now = stp_now_us();
+	unsigned short seed[3];
+
+	seed[0] = (unsigned short) (receivePort ^ getpid());
+	seed[1] = (unsigned short) now;
+	seed[2] = (unsigned short) (now >> 16);
+	return 1 + (unsigned int) (nrand48(seed) % 0x7fff);
+}
+
+void stp_config_defaults(stp_sender_config *cfg)
+{
+	*cfg = defaultConfig;
+}
+
+/*
+ * Whether a connection can run with cfg: the same limits SendApp
+ * checks its options against.
+ */
+static int configValid(const stp_sender_config *cfg)
+{
+	return cfg->maxWin >= 1 && cfg->maxWin <= STP_MAX_WIN_V2 &&
+	       cfg->rtoMinMs >= STP_TIMER_TICK_MS && cfg->rtoMaxMs >= cfg->rtoMinMs &&
+	       cfg->maxRetries >= 1 &&
+	       cfg->maxMtu >= STP_MTU && cfg->maxMtu <= STP_MAX_MTU &&
+	       cfg->maxVersion >= STP_VERSION_1 && cfg->maxVersion <= STP_VERSION_2 &&
+	       cfg->congestion != NULL && stp_cc_find(cfg->congestion) != NULL &&
+	       cfg->maxRate >= 0;
+}
+
+/*
+ * Start opening the sender side of an STP connection: set up a control
+ * block and send the SYN. The connection is established once
+ * stp_process() has seen the SYN-ACK; until then stp_write() says
+ * STP_WOULD_BLOCK. Returns STP_OK with *conn set, or an error.
+ *
+ * The connection keeps a copy of cfg, or of the defaults if cfg is
+ * NULL, so the caller may change or free it as soon as this returns.
+ *
+ * If size is not negative, the SYN tells the receiver that this is how
+ * many bytes will be sent, so that it can place them in the file as
+ * they come. A connection with a non-negative offset sends the "size"
+ * bytes at "offset" in a file that is being sent over several
+ * connections at once, all with the same "transfer" number, which the
+ * receiver uses to put the stripes together into one file.
+ *
+ * Note, to simplify things we use connect(). When used with a UDP
+ * socket all packets then sent and received on the given file
+ * descriptor go to and are received from the specified host. Reads
+ * and writes are still completed in a datagram unit size, but the
+ * application does not have to do the multiplexing and
+ * demultiplexing.
+ */
+int stp_connect(stp_send_ctrl_blk **conn, const stp_sender_config *cfg, char *destination,
+		int destinationPort, int receivePort, long long size, unsigned int transfer,
+		long long offset)
+{
+	stp_send_ctrl_blk *stp_CB;
+	unsigned short offer;
+	unsigned char version, wscale = 0, cksum = STP_CKSUM_CRC32C;
+	unsigned int sizeOpt[2], stripeOpt[3];
+	int mtu, sock;
+
+	if (cfg == NULL)
+		cfg = &defaultConfig;
+	if (!configValid(cfg))
+		return STP_ERR_CONFIG;
+	version = cfg->maxVersion;
+
+	// pseudo random seqnumber to start the tcp communication
+	int tempISN = initialSeqNum(receivePort);
+	stp_log(STP_LOG_DEBUG, "MAX_RAND %d\n", tempISN);
+
+	stp_log(STP_LOG_INFO, "Configuring  UDP \"connection\" to %s, sending to port %d listening for data on port %d\n",
+          destination, destinationPort, receivePort);
+
+	if ((sock = open_udp(destination, destinationPort, receivePort)) < 0) /* UDP socket descriptor */
+		return sock == -4 ? STP_ERR_ADDRESS : STP_ERR_SOCKET;
+
+	if ((stp_CB = (stp_send_ctrl_blk *) calloc(1, sizeof(*stp_CB))) == NULL)
+	{
+		close(sock);
+		return STP_ERR_NOMEM;
+	}
+	stp_CB->sock = sock;
+	stp_CB->cfg = *cfg;
+	stp_CB->ccOps = stp_cc_find(cfg->congestion);
+	stp_CB->cfg.congestion = stp_CB->ccOps->name;
+	stp_CB->swnd = cfg->maxWin;    /* latest advertised sender window */
+	stp_CB->version = STP_VERSION_1;
+	stp_CB->cksum = STP_CKSUM_SUM;
+	stp_CB->sndWscale = 0;
+	stp_CB->maxWin = cfg->maxWin;
+	stp_CB->NextSeqNum =0;     /* last byte ACKed */
+
+	stp_CB->ISN = tempISN;        //initial sequence number should not be zero, this is a random number
+	stp_CB->LBSent=stp_CB->ISN; 	/* last byte Sent not ACKed */
+
+	stp_CB->numBytesInFlight = 0;
+	stp_CB->srtt = -1;
+	stp_CB->rttvar = 0;
+	stp_CB->rto = RTO_INITIAL;
+	stp_CB->sendQueue = NULL;
+	stp_CB->sendQueueTail = NULL;
+	stp_timer_init(&stp_CB->ctrlTimer, controlTimedOut, stp_CB);
+
+	/* The loop makes the socket nonblocking; the blocking calls wait on it */
+	if (stp_loop_init(&stp_CB->loop) < 0 ||
+	    stp_loop_add(&stp_CB->loop, stp_CB->sock, readAcks, stp_CB) < 0)
+	{
+		int saved = errno;
+
+		stp_loop_destroy(&stp_CB->loop);
+		close(stp_CB->sock);
+		free(stp_CB);
+		errno = saved;
+		return STP_ERR_SOCKET;
+	}
+	stp_batch_init(&stp_CB->batch, stp_CB->sock, 0);
+	/*
+	 * Nothing tells us when the kernel is done with a MSG_ZEROCOPY
+	 * send, so it is only used for payloads in the caller's memory,
+	 * never for segment buffers that the pool hands out again.
+	 */
+	if (cfg->zeroCopy && cfg->segmentCopy)
+		stp_log(STP_LOG_WARN, "MSG_ZEROCOPY only for segments sent from the caller's memory, copying\n");
+	else if (cfg->zeroCopy && stp_batch_zerocopy(&stp_CB->batch) < 0)
+		stp_log(STP_LOG_WARN, "MSG_ZEROCOPY not supported, copying segments\n");
+	if (cfg->txTime && stp_batch_txtime(&stp_CB->batch) < 0)
+		stp_log(STP_LOG_WARN, "SO_TXTIME not supported, pacing in user space only\n");
+	stp_CB->paceNext = 0;
+
+	/* Offer the largest MSS our MTU (and, if asked, the path) allows */
+	mtu = cfg->maxMtu;
+	if (cfg->pathMtu && (mtu = stp_path_mtu(stp_CB->sock, mtu)) < 0)
+	{
+		int saved = errno;
+
+		stp_free(stp_CB);
+		errno = saved;
+		return STP_ERR_SOCKET;
+	}
+	offer = htons(mtu - STP_HEADER_LEN(cfg->maxVersion));
+	stp_CB->synOptsLen = stp_put_option(stp_CB->synOpts, 0, STP_OPT_MSS,
+					    &offer, sizeof(offer));
+	if (cfg->maxVersion >= STP_VERSION_2)
+	{
+		/* We never advertise a window that needs scaling */
+		stp_CB->synOptsLen = stp_put_option(stp_CB->synOpts, stp_CB->synOptsLen,
+						    STP_OPT_VERSION, &version, sizeof(version));
+		stp_CB->synOptsLen = stp_put_option(stp_CB->synOpts, stp_CB->synOptsLen,
+						    STP_OPT_WSCALE, &wscale, sizeof(wscale));
+		if (cfg->crc32c)
+			stp_CB->synOptsLen = stp_put_option(stp_CB->synOpts, stp_CB->synOptsLen,
+							    STP_OPT_CKSUM, &cksum, sizeof(cksum));
+	}
+	if (size >= 0)
+	{
+		sizeOpt[0] = htonl((unsigned int) (size >> 32));
+		sizeOpt[1] = htonl((unsigned int) size);
+		stp_CB->synOptsLen = stp_put_option(stp_CB->synOpts, stp_CB->synOptsLen,
+						    STP_OPT_SIZE, sizeOpt, sizeof(sizeOpt));
+	}
+	if (offset >= 0)
+	{
+		stripeOpt[0] = htonl(transfer);
+		stripeOpt[1] = htonl((unsigned int) (offset >> 32));
+		stripeOpt[2] = htonl((unsigned int) offset);
+		stp_CB->synOptsLen = stp_put_option(stp_CB->synOpts, stp_CB->synOptsLen,
+						    STP_OPT_STRIPE, stripeOpt, sizeof(stripeOpt));
+	}
+
+	stp_CB->state = STP_SYN_SENT;	 /* protocol state*/
+	sendControl(stp_CB);
+	if (stp_CB->error != 0)
+	{
+		int error = failed(stp_CB);
+
+		stp_free(stp_CB);
+		return error;
+	}
+
+	*conn = stp_CB;
+	return STP_OK;
+}
+
+/*
+ * Send whatever is batched, wait until either packets arrive or the
+ * connection's next deadline (see stp_timeout()) has passed, then run
+ * the timers that have expired.
+ *
+ * Returns STP_SUCCESS, or STP_ERROR if the connection failed.
+ */
+static int waitForAck(stp_send_ctrl_blk *stp_CB)
+{
+	int ms;
+
+	flushBatch(stp_CB);
+
+	/* Nothing in flight and no pacing delay: wait for an ACK, but not for ever */
+	if ((ms = stp_timeout(stp_CB)) < 0)
+		ms = stp_CB->rto;
+
+	if (stp_CB->error == 0 && stp_loop_run(&stp_CB->loop, ms) < 0)
+		fail(stp_CB, STP_ERR_SOCKET);
+
+	sendFin(stp_CB);
+	if (stp_CB->error == 0)
+		flushBatch(stp_CB);
+	if (stp_CB->error != 0)
+	{
+		failed(stp_CB);
+		return STP_ERROR;
+	}
+	return STP_SUCCESS;
+}
+
+/*
+ * Open the sender side of the STP connection, configured by cfg (NULL
+ * for the defaults), and wait until it is
+ * established. Returns the pointer to a newly allocated control block
+ * containing the basic information about the connection, or NULL if
+ * an error happened (errno is EINVAL if cfg was not valid). See
+ * stp_connect() for the arguments.
+ */
+stp_send_ctrl_blk * stp_open_stripe(const stp_sender_config *cfg, char *destination,
+                                    int destinationPort, int receivePort, long long size,
+                                    unsigned int transfer, long long offset) {
+	stp_send_ctrl_blk *stp_CB;
+	int ret = stp_connect(&stp_CB, cfg, destination, destinationPort, receivePort,
+			      size, transfer, offset);
+
+	if (ret != STP_OK)
+	{
+		if (ret == STP_ERR_CONFIG)
+			errno = EINVAL;
+		return NULL;
+	}
+
+	while (stp_CB->state == STP_SYN_SENT)
+		if (waitForAck(stp_CB) == STP_ERROR)
+			break;
+
+	if (stp_CB->error != 0)
+	{
+		int saved = errno;
+
+		stp_free(stp_CB);
+		errno = saved;
+		return NULL;
+	}
+	return stp_CB;
+}
+
+stp_send_ctrl_blk * stp_open(char *destination, int destinationPort,
+                             int receivePort, long long size) {
+	return stp_open_stripe(NULL, destination, destinationPort, receivePort, size, 0, -1);
+}
+
+/*
+ * Queue all of the data, waiting for ACKs whenever the window is
+ * full. Segments stay in the send queue until they are cumulatively
+ * acknowledged, so this returns as soon as the data is in flight.
+ */
+static int sendAll(stp_send_ctrl_blk *stp_CB, unsigned char *data, int length, int copy)
+{
+	while (length > 0)
+	{
+		int n = writable(stp_CB, copy);
+
+		if (n == STP_WOULD_BLOCK)
+			n = 0;
+		else if (n != 0)
+			return STP_ERROR;
+		else
+			n = queueData(stp_CB, data, length, copy);
+
+		data += n;
+		length -= n;
+		if (length > 0 && waitForAck(stp_CB) == STP_ERROR)
+			return STP_ERROR;
+	}
+	return STP_SUCCESS;
+}
+
+/*
+ * Send STP. This routine is to send a data packet no greater than
+ * MSS bytes. If more than MSS bytes are to be sent, the routine
+ * breaks the data into multiple packets. It will keep sending data
+ * until the send window is full. At which point it reads data from
+ * the network to, hopefully, get the ACKs that open the window.
+ *
+ * The function returns STP_SUCCESS on success, or STP_ERROR on error.
+ */
+int stp_send (stp_send_ctrl_blk *stp_CB, unsigned char* data, int length) {
+	return sendAll(stp_CB, data, length, 1);
+}
+
+/*
+ * Like stp_send(), but without copying, as stp_write_mapped(). The
+ * memory must stay as it is until stp_close() returns; the sender
+ * uses this for a file it has mapped.
+ */
+int stp_send_mapped (stp_send_ctrl_blk *stp_CB, unsigned char* data, int length) {
+	return sendAll(stp_CB, data, length, 0);
+}
+
+/*
+ * Make sure all the outstanding data has been transmitted and
+ * acknowledged, and then close the connection. This also frees the
+ * control block, after filling in its final counters if stats is not
+ * NULL (see stp_stats()), whether the close worked or not. Returns
+ * STP_SUCCESS on success or STP_ERROR on error.
+ */
+int stp_close_stats(stp_send_ctrl_blk *stp_CB, stp_sender_stats *stats) {
+	int ret, saved;
+
+	while ((ret = stp_shutdown(stp_CB)) == STP_WOULD_BLOCK)
+		if (waitForAck(stp_CB) == STP_ERROR)
+			break;
+
+	saved = errno;
+	if (stats != NULL)
+		stp_stats(stp_CB, stats);
+	stp_free(stp_CB);
+	errno = saved;
+	return ret == STP_OK ? STP_SUCCESS : STP_ERROR;
+}
+
+int stp_close(stp_send_ctrl_blk *stp_CB) {
+	return stp_close_stats(stp_CB, NULL);
+}
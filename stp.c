@@ -13,10 +13,18 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/epoll.h>
+#endif
 
 #include "stp.h"
 
@@ -40,17 +48,38 @@ unsigned int hostname_to_ipaddr(const char *s)
   }
 }
 
+/*
+ * The fields of a packet header worth logging, whatever its version,
+ * without checking anything. A v1 seqno is the 16 bits on the wire.
+ */
+void stp_peek(void *pkt, int *version, int *type, unsigned int *seqno, unsigned int *window)
+{
+  stp_header *stpHeader = (stp_header *) pkt;
+  stp_header_v2 *hdr2 = (stp_header_v2 *) pkt;
+  
+  if (hdr2->version == STP_VERSION_2) {
+    *version = STP_VERSION_2;
+    *type = hdr2->type;
+    *seqno = ntohl(hdr2->seqno);
+    *window = ntohs(hdr2->window);
+  } else {
+    *version = STP_VERSION_1;
+    *type = ntohs(stpHeader->type);
+    *seqno = ntohs(stpHeader->seqno);
+    *window = ntohs(stpHeader->window);
+  }
+}
+
 /*
  * Print an STP packet to standard output. dir is either 's'ent or
  * 'r'eceived packet
  */
 void dump(char dir, void *pkt, int len)
 {
-  stp_header *stpHeader = (stp_header *) pkt;
-  unsigned short type = ntohs(stpHeader->type);
-  unsigned short seqno = ntohs(stpHeader->seqno);
-  unsigned short win = ntohs(stpHeader->window);
+  int version, type;
+  unsigned int seqno, win;
   
+  stp_peek(pkt, &version, &type, &seqno, &win);
   printf("%c %s seq %u win %u len %d\n", dir,
          (type == STP_DATA) ? "dat" : 
          (type == STP_ACK) ? "ack" : 
@@ -67,27 +96,201 @@ void dump(char dir, void *pkt, int len)
  */
 unsigned char checksum(stp_header *stpHeader, int len) {
   
+  return checksum_iov(stpHeader, (char *)stpHeader->data_octets, len);
+}
+
+/*
+ * Same as checksum(), for a header whose data is stored elsewhere.
+ */
+unsigned char checksum_iov(stp_header *stpHeader, char *data, int len) {
+  
   unsigned char sum = 0;
   int i;
   sum += (stpHeader->type   & 0xff) + (stpHeader->type   >> 8);
   sum += (stpHeader->window & 0xff) + (stpHeader->window >> 8);
   sum += (stpHeader->seqno  & 0xff) + (stpHeader->seqno  >> 8);
+  for (i = 0; i < 32; i += 8)
+    sum += ((stpHeader->tsval >> i) & 0xff) + ((stpHeader->tsecr >> i) & 0xff);
   
   for (i = 0; i < len; i++)
-    sum += stpHeader->data_octets[i];
+    sum += (unsigned char) data[i];
   
   return sum;
 }
 
 
+/*
+ * Checksum of a v2 packet with the given algorithm. The checksum
+ * field must be zero while it is computed.
+ */
+static unsigned int checksum_v2(int cksum, unsigned char *hdr, int hlen, char *data, int len)
+{
+  unsigned int sum = 0;
+  int i;
+  
+  if (cksum == STP_CKSUM_CRC32C)
+    return stp_crc32c(stp_crc32c(0, hdr, hlen), data, len);
+  
+  for (i = 0; i < hlen; i++)
+    sum += hdr[i];
+  for (i = 0; i < len; i++)
+    sum += (unsigned char) data[i];
+  return sum;
+}
+
+/*
+ * Extend the low 16 bits of a sequence number carried in a v1 header
+ * to the 32-bit value closest to ref.
+ */
+unsigned int stp_seq_extend(unsigned short wire, unsigned int ref)
+{
+  return ref + (short)(unsigned short)(wire - (unsigned short) ref);
+}
+
+/*
+ * Build the header of packet p, in p->version's format, into hdr and
+ * stamp it with our clock. The options are copied behind the fixed
+ * header; the data is not copied, it is only read to compute the
+ * checksum, and goes out right after the header. Returns the length
+ * of the header, options included.
+ *
+ * A v1 packet has no room for options in its header, so they take
+ * the place of the data; only SYNs and ACKs, which carry none, have
+ * options.
+ */
+int stp_encode(stp_hdrbuf *hdr, stp_pkt *p)
+{
+  unsigned int tsval = stp_timestamp();
+  int hlen;
+  
+  if (p->version < STP_VERSION_2) {
+    unsigned char sum;
+    int i;
+    
+    hdr->v1.type = htons(p->type);
+    hdr->v1.window = htons(p->window);
+    hdr->v1.seqno = htons(p->seqno);
+    hdr->v1.reserved = 0;
+    hdr->v1.tsval = htonl(tsval);
+    hdr->v1.tsecr = htonl(p->tsecr);
+    hlen = sizeof(stp_header);
+    if (p->optsLen > 0) {
+      memcpy(hdr->bytes + hlen, p->opts, p->optsLen);
+      hlen += p->optsLen;
+    }
+    sum = checksum_iov(&hdr->v1, (char *) hdr->v1.data_octets, hlen - sizeof(stp_header));
+    for (i = 0; i < p->len; i++)
+      sum += (unsigned char) p->data[i];
+    hdr->v1.checksum = sum;
+    return hlen;
+  }
+  
+  hdr->v2.version = STP_VERSION_2;
+  hdr->v2.type = p->type;
+  hdr->v2.window = htons(p->window);
+  hdr->v2.seqno = htonl(p->seqno);
+  hdr->v2.tsval = htonl(tsval);
+  hdr->v2.tsecr = htonl(p->tsecr);
+  hdr->v2.checksum = 0;
+  hdr->v2.cksum = p->cksum;
+  hdr->v2.reserved = 0;
+  hlen = sizeof(stp_header_v2);
+  if (p->optsLen > 0) {
+    memcpy(hdr->v2.options, p->opts, p->optsLen);
+    hlen += p->optsLen;
+    while (hlen % 4 != 0)
+      hdr->bytes[hlen++] = STP_OPT_END;
+  }
+  hdr->v2.hlen = htons(hlen);
+  hdr->v2.checksum = htonl(checksum_v2(p->cksum, hdr->bytes, hlen, p->data, p->len));
+  return hlen;
+}
+
+/*
+ * Decode the len-byte packet at pkt into p, whose pointers then
+ * refer into pkt. The low 16 bits of the sequence number in a v1
+ * header are extended relative to ref (see stp_seq_extend()).
+ * Returns 0, STP_TRUNCATED if the packet is too short to hold its
+ * header, or STP_CORRUPTED if the checksum (or format) is wrong.
+ */
+int stp_decode(stp_pkt *p, void *pkt, int len, unsigned int ref)
+{
+  stp_header_v2 *hdr2 = (stp_header_v2 *) pkt;
+  int hlen;
+  
+  if (len < (int) sizeof(stp_header))
+    return STP_TRUNCATED;
+  
+  if (hdr2->version != STP_VERSION_2) {
+    stp_header *hdr = (stp_header *) pkt;
+    
+    if (hdr2->version != 0)
+      return STP_CORRUPTED;
+    if (hdr->checksum != checksum(hdr, len - sizeof(stp_header)))
+      return STP_CORRUPTED;
+    
+    p->version = STP_VERSION_1;
+    p->cksum = STP_CKSUM_SUM;
+    p->type = ntohs(hdr->type);
+    p->seqno = stp_seq_extend(ntohs(hdr->seqno), ref);
+    p->window = ntohs(hdr->window);
+    p->tsval = ntohl(hdr->tsval);
+    p->tsecr = ntohl(hdr->tsecr);
+    p->opts = p->data = (char *) hdr->data_octets;
+    p->optsLen = p->len = 0;
+    if (p->type == STP_DATA)
+      p->len = len - sizeof(stp_header);
+    else
+      p->optsLen = len - sizeof(stp_header);
+    return 0;
+  }
+  
+  if (len < (int) sizeof(stp_header_v2))
+    return STP_TRUNCATED;
+  hlen = ntohs(hdr2->hlen);
+  
+  /* The fast path: a packet without options */
+  if (hlen != sizeof(stp_header_v2) &&
+      (hlen < (int) sizeof(stp_header_v2) || hlen % 4 != 0 || hlen > len))
+    return STP_CORRUPTED;
+  if (hdr2->cksum != STP_CKSUM_SUM && hdr2->cksum != STP_CKSUM_CRC32C)
+    return STP_CORRUPTED;
+  
+  {
+    unsigned int sum = hdr2->checksum;
+    int ok;
+    
+    hdr2->checksum = 0;
+    ok = ntohl(sum) == checksum_v2(hdr2->cksum, (unsigned char *) pkt, hlen,
+                                   (char *) pkt + hlen, len - hlen);
+    hdr2->checksum = sum;
+    if (!ok)
+      return STP_CORRUPTED;
+  }
+  
+  p->version = STP_VERSION_2;
+  p->cksum = hdr2->cksum;
+  p->type = hdr2->type;
+  p->seqno = ntohl(hdr2->seqno);
+  p->window = ntohs(hdr2->window);
+  p->tsval = ntohl(hdr2->tsval);
+  p->tsecr = ntohl(hdr2->tsecr);
+  p->opts = (char *) hdr2->options;
+  p->optsLen = hlen - sizeof(stp_header_v2);
+  p->data = (char *) pkt + hlen;
+  p->len = len - hlen;
+  return 0;
+}
+
 /*
  * Helper function to send an stp packet over the network.
  * As a side effect print the packet header to standard output.
+ * Returns 0, or -1 (with errno set) if it could not be sent.
  */
-void sendpkt(int fd, int type, unsigned short window,
-             unsigned short seqno, char* data, int len)
+int sendpkt(int fd, int type, unsigned short window,
+            unsigned short seqno, char* data, int len)
 {
-  sendpkt2(fd, type, window, seqno, data, len, 0);
+  return sendpkt2(fd, type, window, seqno, data, len, 0);
 }
 
 /*
@@ -95,99 +298,747 @@ void sendpkt(int fd, int type, unsigned short window,
  * As a side effect print the packet header to standard output.
  * Has an option to corrupt the packet.
  */
-void sendpkt2(int fd, int type, unsigned short window,
-              unsigned short seqno, char* data, int len, int corrupted)
+int sendpkt2(int fd, int type, unsigned short window,
+             unsigned short seqno, char* data, int len, int corrupted)
 {
-  unsigned char wrk[STP_MTU];
-  stp_header *stpHeader = (stp_header *)wrk;
-  stpHeader->type = htons(type);
-  stpHeader->window = htons(window);
-  stpHeader->seqno = htons(seqno);
-  if (data != 0) {
-    memcpy((char*)(stpHeader + 1), data, len);
-  }
-  stpHeader->checksum = checksum(stpHeader, len);
+  stp_pkt p;
   
-  if (corrupted) {
-    int random_byte = lrand48() % (sizeof(stp_header) + len);
-    int random_bit = lrand48() % 8;
-    //printf("SENT PACKET CORRUPTED: byte %d from %02x",
-    //random_byte, wrk[random_byte]);
-    printf("SENT PACKET CORRUPTED\n");
-    wrk[random_byte] ^= (char) (1 << random_bit);
-    // printf(" to %02x\n", wrk[random_byte]);
-  }
+  memset(&p, 0, sizeof(p));
+  p.version = STP_VERSION_1;
+  p.type = type;
+  p.window = window;
+  p.seqno = seqno;
+  p.data = data;
+  p.len = len;
+  return stp_sendpkt(fd, &p, corrupted);
+}
+
+/*
+ * Send packet p, in the format of p->version, stamped with our clock
+ * so that the peer can echo it back. Has an option to corrupt the
+ * packet. Returns 0, or -1 (with errno set) if it could not be sent.
+ */
+int stp_sendpkt(int fd, stp_pkt *p, int corrupted)
+{
+  return stp_sendpkt_to(fd, p, corrupted, NULL);
+}
+
+/*
+ * The same, for a socket that is not connected: the packet goes to
+ * "to", or to the connected peer if that is NULL.
+ */
+int stp_sendpkt_to(int fd, stp_pkt *p, int corrupted, struct sockaddr_in *to)
+{
+  unsigned char *wrk;
+  stp_hdrbuf hdr;
+  struct iovec iov[2];
+  struct msghdr msg;
+  int hlen, random_byte, random_bit, cc;
   
-  dump('s', wrk, len + sizeof(stp_header));
-  if (send(fd, wrk, len + sizeof(stp_header), 0) < 0) {
-    perror("write");
-    exit(1);
+  hlen = stp_encode(&hdr, p);
+  
+  if (!corrupted) {
+    /* Header and data go out as they are, without staging them */
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = p->data;
+    iov[1].iov_len = p->len;
+    msg.msg_name = to;
+    msg.msg_namelen = to != NULL ? sizeof(*to) : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = p->len > 0 ? 2 : 1;
+    
+    stp_trace('s', &hdr, hlen + p->len);
+    return sendmsg(fd, &msg, 0) < 0 ? -1 : 0;
   }
+  
+  /* Corrupting must not touch the caller's data, so work on a copy */
+  if ((wrk = (unsigned char *) malloc(hlen + p->len)) == NULL)
+    return -1;
+  memcpy(wrk, &hdr, hlen);
+  if (p->len > 0)
+    memcpy(wrk + hlen, p->data, p->len);
+  
+  random_byte = lrand48() % (hlen + p->len);
+  random_bit = lrand48() % 8;
+  //printf("SENT PACKET CORRUPTED: byte %d from %02x",
+  //random_byte, wrk[random_byte]);
+  stp_log(STP_LOG_DEBUG, "SENT PACKET CORRUPTED\n");
+  wrk[random_byte] ^= (char) (1 << random_bit);
+  // printf(" to %02x\n", wrk[random_byte]);
+  
+  stp_trace('s', wrk, hlen + p->len);
+  cc = sendto(fd, wrk, hlen + p->len, 0, (struct sockaddr *) to,
+              to != NULL ? sizeof(*to) : 0);
+  free(wrk);
+  return cc < 0 ? -1 : 0;
 }
 
 
 /*
  * Helper function to read a STP packet from the network.
- * As a side effect print the packet header to standard output.
+ * As a side effect trace the packet (see stp_trace()).
  */
 int readpkt(int fd, void *pkt, int len)
 {
   int cc = recv(fd, pkt, len, 0);
   if (cc > 0) {
-    dump('r', pkt, cc);
+    stp_trace('r', pkt, cc);
   }
   return (cc);
 }
 
 /*
- * Reset the network connection by sending an RESET packet, print an error
- * message to standard output, and exit.
+ * Reset the network connection by sending an RESET packet. What to
+ * do next is the caller's business. Returns 0, or -1 (with errno
+ * set) if the RESET could not be sent.
  */
-void reset(int fd)
+int reset(int fd)
 {
-  fprintf(stderr, "protocol error encountered... resetting connection\n");
-  sendpkt(fd, STP_RESET, 0, 0, 0, 0);
-  exit(0);
+  return sendpkt(fd, STP_RESET, 0, 0, 0, 0);
 }
 
 
 /*
- * Read a packet from the network but if "ms" milliseconds transpire
- * before a packet arrives, abort the read attempt and return
- * STP_TIMED_OUT. Otherwise, return the length of the packet read.
+ * Read a packet of at most len bytes from the network but if "ms"
+ * milliseconds transpire before a packet arrives, abort the read
+ * attempt and return STP_TIMED_OUT. Otherwise, return the length of
+ * the packet read.
  */
-int readWithTimer(int fd, char *pkt, int ms)
+int readWithTimer(int fd, char *pkt, int len, int ms)
 {
-  int s;
-  fd_set fds;
-  struct timeval tv;
+  struct pollfd pfd;
   
-  tv.tv_sec = ms / 1000;
-  tv.tv_usec = (ms - tv.tv_sec * 1000) * 1000;
-  
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-  s = select(fd + 1, &fds, 0, 0, &tv);
-  if (FD_ISSET(fd, &fds))
-    return readpkt(fd, pkt, STP_MTU);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, ms) > 0 && (pfd.revents & (POLLIN | POLLERR)))
+    return readpkt(fd, pkt, len);
   else
     return STP_TIMED_OUT;
 }
 
 /*
- * Set an I/O channel (file descriptor) to non-blocking mode.
+ * Set an I/O channel (file descriptor) to non-blocking mode. Returns
+ * 0, or -1 with errno set if fcntl() failed.
  */
-void nonblock(int fd)
+int nonblock(int fd)
 {       
   int flags = fcntl(fd, F_GETFL, 0);
+  
+  if (flags == -1)
+    return -1;
 #if defined(hpux) || defined(__hpux)
   flags |= O_NONBLOCK;
 #else
   flags |= O_NONBLOCK|O_NDELAY;
 #endif
-  if (fcntl(fd, F_SETFL, flags) == -1) {
-    perror("fcntl: F_SETFL");
-    exit(1);
+  return fcntl(fd, F_SETFL, flags) == -1 ? -1 : 0;
+}
+
+
+/*
+ * The event loop. One wait covers every socket on the loop and the
+ * earliest timer of its wheel, so a loop with nothing to do sleeps
+ * until a packet arrives or a timer is due, however many connections
+ * it carries.
+ *
+ * Sockets are made nonblocking and, with epoll, edge-triggered: the
+ * handler of a socket is called once when packets arrive and has to
+ * read until recv() says EAGAIN, or it will not hear of that socket
+ * again. Where there is no epoll the loop polls its sockets, which
+ * works with the same handlers.
+ */
+
+/*
+ * Set up an empty loop. Returns 0, or -1 if the epoll instance could
+ * not be created.
+ */
+int stp_loop_init(stp_loop *loop)
+{
+  int i;
+  
+  memset(loop, 0, sizeof(*loop));
+  for (i = 0; i < STP_LOOP_MAX_FDS; i++)
+    loop->io[i].fd = -1;
+  stp_timer_wheel_init(&loop->timers, stp_now_ms());
+#if defined(__linux__)
+  if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return -1;
+#else
+  loop->epfd = -1;
+#endif
+  return 0;
+}
+
+void stp_loop_destroy(stp_loop *loop)
+{
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  loop->epfd = -1;
+}
+
+/*
+ * Watch fd, which becomes nonblocking, and call fn(fd, arg) whenever
+ * packets arrive on it. Returns 0, or -1 if the loop is full or fd
+ * could not be made nonblocking or added to epoll.
+ */
+int stp_loop_add(stp_loop *loop, int fd, void (*fn)(int fd, void *arg), void *arg)
+{
+  int i;
+  
+  for (i = 0; i < STP_LOOP_MAX_FDS && loop->io[i].fd >= 0; i++)
+    ;
+  if (i == STP_LOOP_MAX_FDS)
+    return -1;
+  
+  if (nonblock(fd) < 0)
+    return -1;
+#if defined(__linux__)
+  {
+    struct epoll_event ev;
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loop->io[i];
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      return -1;
+  }
+#endif
+  loop->io[i].fd = fd;
+  loop->io[i].fn = fn;
+  loop->io[i].arg = arg;
+  if (i >= loop->nio)
+    loop->nio = i + 1;
+  return 0;
+}
+
+/*
+ * Stop watching fd. Must be called before fd is closed.
+ */
+void stp_loop_del(stp_loop *loop, int fd)
+{
+  int i;
+  
+  for (i = 0; i < loop->nio; i++)
+    if (loop->io[i].fd == fd) {
+#if defined(__linux__)
+      epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+      loop->io[i].fd = -1;
+    }
+  while (loop->nio > 0 && loop->io[loop->nio - 1].fd < 0)
+    loop->nio--;
+}
+
+/*
+ * Wait until a socket on the loop has packets, its earliest timer is
+ * due or "ms" milliseconds have passed (a negative ms sets no limit
+ * of its own), call the handlers of the sockets that are ready and
+ * then run the timers that have expired. Returns the number of
+ * sockets that were ready, or -1 if the wait failed.
+ */
+int stp_loop_run(stp_loop *loop, int ms)
+{
+  int i, n, next = stp_timer_next_ms(&loop->timers, stp_now_ms());
+  
+  if (next >= 0 && (ms < 0 || next < ms))
+    ms = next;
+  
+#if defined(__linux__)
+  {
+    struct epoll_event evs[STP_LOOP_MAX_FDS];
+    
+    n = epoll_wait(loop->epfd, evs, STP_LOOP_MAX_FDS, ms);
+    for (i = 0; i < n; i++) {
+      stp_loop_io *io = (stp_loop_io *) evs[i].data.ptr;
+      
+      if (io->fd >= 0)
+        io->fn(io->fd, io->arg);
+    }
   }
+#else
+  {
+    struct pollfd pfds[STP_LOOP_MAX_FDS];
+    
+    for (i = 0; i < loop->nio; i++) {
+      pfds[i].fd = loop->io[i].fd;
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+    n = poll(pfds, loop->nio, ms);
+    for (i = 0; i < loop->nio && n > 0; i++)
+      if (pfds[i].revents != 0 && loop->io[i].fd >= 0)
+        loop->io[i].fn(loop->io[i].fd, loop->io[i].arg);
+  }
+#endif
+  if (n < 0 && errno != EINTR)
+    return -1;
+  
+  stp_timer_expire(&loop->timers, stp_now_ms());
+  return n > 0 ? n : 0;
 }
 
+
+/*
+ * Milliseconds on a monotonic clock. Only useful for computing
+ * deadlines and intervals, not as a wall-clock time.
+ */
+long long stp_now_ms(void)
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Microseconds on the same clock as stp_now_ms().
+ */
+long long stp_now_us(void)
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Timestamp carried in the tsval field of every packet: our monotonic
+ * clock in ms, truncated to 32 bits. Never 0, since an echo of 0
+ * means "no timestamp".
+ */
+unsigned int stp_timestamp(void)
+{
+  unsigned int ts = (unsigned int)stp_now_ms();
+  
+  return ts != 0 ? ts : 1;
+}
+
+/*
+ * Batched datagram I/O. A batch collects up to STP_BATCH_MAX packets
+ * that go out with one sendmmsg(), or receives as many as are queued
+ * on the socket with one recvmmsg(). Where those calls do not exist
+ * the batch falls back to one send()/recv() per packet.
+ *
+ * Outgoing packets are scatter/gather: the header is built in the
+ * batch and the data is sent straight from the caller's memory.
+ */
+/*
+ * Set up a batch on socket fd. A batch that receives needs room for
+ * STP_BATCH_MAX packets of "mtu" bytes; a batch that only sends can
+ * pass an mtu of 0. Returns 0 on success, -1 if out of memory.
+ */
+int stp_batch_init(stp_batch *batch, int fd, int mtu)
+{
+  memset(batch, 0, sizeof(*batch));
+  batch->fd = fd;
+  batch->mtu = mtu;
+  if (mtu > 0 && (batch->bufs = (unsigned char *) malloc((size_t)mtu * STP_BATCH_MAX)) == NULL)
+    return -1;
+  return 0;
+}
+
+void stp_batch_destroy(stp_batch *batch)
+{
+  free(batch->bufs);
+  batch->bufs = NULL;
+}
+
+/*
+ * Send large packets of this batch with MSG_ZEROCOPY, so that the
+ * kernel transmits straight from our pages instead of copying them.
+ * Returns 0 if zerocopy is now on, -1 if the kernel does not do it.
+ */
+int stp_batch_zerocopy(stp_batch *batch)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+  int one = 1;
+  
+  if (setsockopt(batch->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+    batch->zerocopy = 1;
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+/*
+ * Hand the departure time of every packet to the kernel with
+ * SO_TXTIME, so that a qdisc that honours it (fq) releases paced
+ * packets at the right microsecond rather than in bursts. Returns 0
+ * if the socket accepted it, -1 if the kernel does not do it.
+ */
+int stp_batch_txtime(stp_batch *batch)
+{
+#if defined(SO_TXTIME) && defined(__linux__)
+  struct sock_txtime cfg;
+  
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.clockid = CLOCK_MONOTONIC;
+  if (setsockopt(batch->fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0) {
+    batch->txtime = 1;
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+/*
+ * Drain the completion notifications of MSG_ZEROCOPY sends from the
+ * socket error queue, without blocking, so that the socket does not
+ * run out of option memory. Nothing waits for them: an ACK does not
+ * prove that the kernel is done with a page, since a retransmission
+ * of the same data may still be queued, so zerocopy must only be used
+ * for memory that is not reused while the connection is open.
+ */
+static void stp_batch_reap(stp_batch *batch)
+{
+#if defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+  char control[128];
+  struct msghdr msg;
+  
+  do {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+  } while (recvmsg(batch->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+#endif
+}
+
+/*
+ * Queue a packet for sending; the batch is flushed when it is full.
+ * The data is referenced, not copied, and must stay untouched until
+ * the batch has been flushed. With SO_TXTIME on, the packet leaves no
+ * earlier than departUs (see stp_now_us()); 0 means right away.
+ * Returns 0, or -1 if the batch is still full after the flush (the
+ * socket buffer is), in which case the packet was not queued and the
+ * caller has to try it again later.
+ */
+int stp_batch_add(stp_batch *batch, stp_pkt *p, long long departUs)
+{
+  int i;
+  
+  if (batch->count == STP_BATCH_MAX)
+    stp_batch_flush(batch);
+  if (batch->count == STP_BATCH_MAX)
+    return -1;
+  
+  i = batch->count++;
+  batch->iov[i][0].iov_base = &batch->hdrs[i];
+  batch->iov[i][0].iov_len = stp_encode(&batch->hdrs[i], p);
+  batch->iov[i][1].iov_base = p->data;
+  batch->iov[i][1].iov_len = p->len;
+  memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+  batch->msgs[i].msg_hdr.msg_iov = batch->iov[i];
+  batch->msgs[i].msg_hdr.msg_iovlen = p->len > 0 ? 2 : 1;
+  
+#if defined(SO_TXTIME) && defined(__linux__)
+  if (batch->txtime && departUs > 0) {
+    struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    struct cmsghdr *cm;
+    unsigned long long ns = (unsigned long long) departUs * 1000;
+    
+    msg->msg_control = batch->txctrl[i];
+    msg->msg_controllen = CMSG_SPACE(sizeof(ns));
+    cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_TXTIME;
+    cm->cmsg_len = CMSG_LEN(sizeof(ns));
+    memcpy(CMSG_DATA(cm), &ns, sizeof(ns));
+  }
+#endif
+  return 0;
+}
+
+static int stp_batch_large(stp_batch *batch, int i)
+{
+  return batch->zerocopy && batch->iov[i][1].iov_len >= STP_ZEROCOPY_MIN;
+}
+
+/*
+ * Move the packets from "first" on to the front of the batch.
+ */
+static void stp_batch_keep(stp_batch *batch, int first)
+{
+  int i;
+  
+  for (i = 0; first + i < batch->count; i++) {
+    batch->hdrs[i] = batch->hdrs[first + i];
+    batch->iov[i][0].iov_base = &batch->hdrs[i];
+    batch->iov[i][0].iov_len = batch->iov[first + i][0].iov_len;
+    batch->iov[i][1] = batch->iov[first + i][1];
+    batch->msgs[i] = batch->msgs[first + i];
+    batch->msgs[i].msg_hdr.msg_iov = batch->iov[i];
+    if (batch->msgs[i].msg_hdr.msg_control != NULL) {
+      memcpy(batch->txctrl[i], batch->txctrl[first + i], sizeof(batch->txctrl[i]));
+      batch->msgs[i].msg_hdr.msg_control = batch->txctrl[i];
+    }
+  }
+  batch->count = i;
+}
+
+/*
+ * Send every queued packet. With zerocopy on, runs of large packets
+ * and runs of small ones go out in separate sendmmsg() calls. If the
+ * socket buffer is full, the packets that did not fit stay in the
+ * batch, batch->full is set, and the next flush tries them again; the
+ * caller should hold back new packets until it has. Any other failure
+ * is kept in batch->error. Returns 0, or -1 if a send has failed
+ * since the batch was set up.
+ */
+int stp_batch_flush(stp_batch *batch)
+{
+  int i, sent = 0;
+  
+  batch->full = 0;
+  while (sent < batch->count) {
+    int run = 1, flags = 0, cc;
+    
+#if defined(MSG_ZEROCOPY)
+    if (stp_batch_large(batch, sent))
+      flags = MSG_ZEROCOPY;
+#endif
+    while (sent + run < batch->count &&
+           stp_batch_large(batch, sent + run) == stp_batch_large(batch, sent))
+      run++;
+    
+#if defined(__linux__)
+    cc = sendmmsg(batch->fd, &batch->msgs[sent], run, flags);
+#else
+    cc = sendmsg(batch->fd, &batch->msgs[sent].msg_hdr, flags) < 0 ? -1 : 1;
+#endif
+    if (cc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        batch->full = 1;
+        break;
+      }
+      if (batch->error == 0)
+        batch->error = errno;
+      sent = batch->count;
+      break;
+    }
+    for (i = sent; i < sent + cc; i++)
+      stp_trace('s', &batch->hdrs[i], batch->iov[i][0].iov_len + batch->iov[i][1].iov_len);
+    sent += cc;
+  }
+  stp_batch_keep(batch, sent);
+  
+  if (batch->zerocopy)
+    stp_batch_reap(batch);
+  if (batch->error != 0) {
+    errno = batch->error;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Wait until at least one packet has arrived, then take everything
+ * that is already queued, up to STP_BATCH_MAX packets. Packet i is at
+ * stp_batch_pkt(batch, i), is stp_batch_len(batch, i) bytes long and came
+ * from stp_batch_from(batch, i). Returns
+ * the number of packets, STP_TIMED_OUT if nothing arrived within "ms"
+ * milliseconds (a negative ms waits for ever, 0 does not wait at all,
+ * which is how a loop handler empties its socket), or -1 on error.
+ */
+int stp_batch_recv(stp_batch *batch, int ms)
+{
+  int i, n, flags = 0;
+  
+  if (ms > 0) {
+    struct pollfd pfd;
+    
+    pfd.fd = batch->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    n = poll(&pfd, 1, ms);
+    if (n < 0)
+      return errno == EINTR ? STP_TIMED_OUT : -1;
+    if (n == 0)
+      return STP_TIMED_OUT;
+  }
+  else if (ms == 0)
+    flags = MSG_DONTWAIT;
+  
+  for (i = 0; i < STP_BATCH_MAX; i++) {
+    batch->iov[i][0].iov_base = stp_batch_pkt(batch, i);
+    batch->iov[i][0].iov_len = batch->mtu;
+    memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+    batch->msgs[i].msg_hdr.msg_name = &batch->from[i];
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->from[i]);
+    batch->msgs[i].msg_hdr.msg_iov = batch->iov[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  
+#if defined(__linux__)
+  n = recvmmsg(batch->fd, batch->msgs, STP_BATCH_MAX, MSG_WAITFORONE | flags, NULL);
+#else
+  {
+    socklen_t fromLen = sizeof(batch->from[0]);
+    
+    n = recvfrom(batch->fd, batch->bufs, batch->mtu, flags,
+                 (struct sockaddr *) &batch->from[0], &fromLen);
+  }
+  if (n >= 0) {
+    batch->msgs[0].msg_len = n;
+    n = 1;
+  }
+#endif
+  
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    batch->count = 0;
+    return STP_TIMED_OUT;
+  }
+  
+  for (i = 0; i < n; i++)
+    stp_trace('r', stp_batch_pkt(batch, i), batch->msgs[i].msg_len);
+  batch->count = n > 0 ? n : 0;
+  return n;
+}
+
+unsigned char *stp_batch_pkt(stp_batch *batch, int i)
+{
+  return batch->bufs + (size_t)i * batch->mtu;
+}
+
+int stp_batch_len(stp_batch *batch, int i)
+{
+  return batch->msgs[i].msg_len;
+}
+
+/* Source address of packet i */
+struct sockaddr_in *stp_batch_from(stp_batch *batch, int i)
+{
+  return &batch->from[i];
+}
+
+/*
+ * Append an option with a len-byte value to the option list at opts,
+ * which currently holds off bytes. Returns the new length of the list.
+ */
+int stp_put_option(char *opts, int off, int kind, void *val, int len)
+{
+  opts[off] = kind;
+  opts[off + 1] = len + 2;
+  memcpy(opts + off + 2, val, len);
+  return off + len + 2;
+}
+
+/*
+ * Look for an option of the given kind in an option list of optsLen
+ * bytes and copy up to len bytes of its value to val. Returns the
+ * length of the value, or -1 if the option is not there (or the list
+ * is malformed).
+ */
+int stp_get_option(char *opts, int optsLen, int kind, void *val, int len)
+{
+  int off = 0;
+  
+  while (off + 2 <= optsLen && opts[off] != STP_OPT_END) {
+    int optLen = (unsigned char) opts[off + 1];
+    
+    if (optLen < 2 || off + optLen > optsLen)
+      return -1;
+    if (opts[off] == kind) {
+      if (len > optLen - 2)
+        len = optLen - 2;
+      memcpy(val, opts + off + 2, len);
+      return optLen - 2;
+    }
+    off += optLen;
+  }
+  return -1;
+}
+
+/*
+ * Append an STP_OPT_SACK option listing n blocks, given in host byte
+ * order, in the wire format of the given version. Returns the new
+ * length of the option list.
+ */
+int stp_put_sack(char *opts, int off, int version, stp_sack_block *blocks, int n)
+{
+  unsigned char val[STP_MAX_SACK_BLOCKS * sizeof(stp_sack_block)];
+  int i, len = 0;
+  
+  for (i = 0; i < n; i++) {
+    if (version >= STP_VERSION_2) {
+      unsigned int v[2];
+      
+      v[0] = htonl(blocks[i].start);
+      v[1] = htonl(blocks[i].end);
+      memcpy(val + len, v, sizeof(v));
+      len += sizeof(v);
+    } else {
+      unsigned short v[2];
+      
+      v[0] = htons(blocks[i].start);
+      v[1] = htons(blocks[i].end);
+      memcpy(val + len, v, sizeof(v));
+      len += sizeof(v);
+    }
+  }
+  return stp_put_option(opts, off, STP_OPT_SACK, val, len);
+}
+
+/*
+ * Read up to max SACK blocks from an option list of the given
+ * version into blocks, in host byte order. v1 sequence numbers are
+ * extended relative to ref. Returns the number of blocks.
+ */
+int stp_get_sack(char *opts, int optsLen, int version, unsigned int ref,
+                 stp_sack_block *blocks, int max)
+{
+  unsigned char val[STP_MAX_OPTIONS];
+  int i, n, width = version >= STP_VERSION_2 ? 8 : 4;
+  
+  n = stp_get_option(opts, optsLen, STP_OPT_SACK, val, sizeof(val));
+  if (n <= 0)
+    return 0;
+  n /= width;
+  if (n > max)
+    n = max;
+  
+  for (i = 0; i < n; i++) {
+    if (version >= STP_VERSION_2) {
+      unsigned int v[2];
+      
+      memcpy(v, val + i * width, sizeof(v));
+      blocks[i].start = ntohl(v[0]);
+      blocks[i].end = ntohl(v[1]);
+    } else {
+      unsigned short v[2];
+      
+      memcpy(v, val + i * width, sizeof(v));
+      blocks[i].start = stp_seq_extend(ntohs(v[0]), ref);
+      blocks[i].end = stp_seq_extend(ntohs(v[1]), ref);
+    }
+  }
+  return n;
+}
+
+/*
+ * Turn on path MTU discovery (don't-fragment) for the connected socket
+ * fd and return the largest STP packet, at most mtu, that fits in the
+ * path MTU the kernel currently knows for the destination, or -1
+ * (with errno set) if the socket would not say.
+ */
+int stp_path_mtu(int fd, int mtu)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_MTU)
+  int val = IP_PMTUDISC_DO;
+  socklen_t len = sizeof(val);
+  
+  if (setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) < 0 ||
+      getsockopt(fd, IPPROTO_IP, IP_MTU, &val, &len) < 0)
+    return -1;
+  
+  val -= 28;  /* IPv4 and UDP headers */
+  if (val < mtu)
+    mtu = val;
+#endif
+  return mtu;
+}
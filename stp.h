@@ -9,13 +9,43 @@
 
 #define __STP_H_
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
 #define STP_MAXWIN    65535 
-#define STP_MTU       300 /* MTU size */
+#define STP_MAX_WIN_V1 32767  /* v1 seqnos are 16 bits: stay under half of that */
+#define STP_MAX_WIN_V2 (1 << 30) /* 32-bit seqnos, window scaled by at most 14 */
+#define STP_MAX_WSCALE 14
+#define STP_MTU       300 /* MTU size of a peer that does not negotiate */
 #define STP_MSS       (STP_MTU - sizeof(stp_header)) /* MSS Size */
+#define STP_MIN_MSS   64  /* smallest MSS either side agrees to */
+#define STP_MAX_MTU   65507 /* largest UDP payload over IPv4 */
+#define STP_DEFAULT_MAX_MTU 1472 /* Ethernet MTU minus IP and UDP headers */
 #define STP_TIMED_OUT (-3)
 
 /* In the above if MSS and MTU don't mean anything to you then read the text */
 
+/*
+ * The MSS actually used on a connection is negotiated: the SYN carries
+ * the largest MSS the sender wants, the SYN-ACK the one the receiver
+ * agreed to. A peer that sends no MSS option gets STP_MSS; one that
+ * asks for less than STP_MIN_MSS gets STP_MIN_MSS.
+ */
+
+/*
+ * Wire versions. Version 1 is the original 16-bit header; version 2
+ * has 32-bit sequence numbers, a scaled window and room for options
+ * in the header. The SYN always goes out as v1 and offers v2 in an
+ * option, the SYN-ACK comes back in the version both sides speak.
+ */
+#define STP_VERSION_1 1
+#define STP_VERSION_2 2
+#define STP_HEADER_LEN(version) \
+  ((int)((version) >= STP_VERSION_2 ? sizeof(stp_header_v2) : sizeof(stp_header)))
+
 
 /*
  * Packet types
@@ -35,6 +65,112 @@
 #define STP_LISTEN      0x22
 #define STP_TIME_WAIT   0x23
 
+/*
+ * Logging (see trace.c). A message is printed if its level is at most
+ * stp_log_level, which the applications set with -L; levels above
+ * STP_LOG_COMPILED are not even compiled in (build with, say,
+ * -DSTP_LOG_COMPILED=STP_LOG_INFO). Everything that happens once per
+ * packet is STP_LOG_DEBUG or above, so by default it costs one compare.
+ */
+#define STP_LOG_ERROR 0
+#define STP_LOG_WARN  1
+#define STP_LOG_INFO  2   /* the default */
+#define STP_LOG_DEBUG 3
+#define STP_LOG_PKT   4   /* also print every packet, as dump() does */
+
+#ifndef STP_LOG_COMPILED
+#define STP_LOG_COMPILED STP_LOG_PKT
+#endif
+
+extern int stp_log_level;
+
+#define stp_log(level, ...)                                             \
+  do {                                                                  \
+    if ((level) <= STP_LOG_COMPILED && (level) <= stp_log_level)        \
+      printf(__VA_ARGS__);                                              \
+  } while (0)
+
+/*
+ * Packet trace (see trace.c). Every packet sent or received leaves a
+ * record in a fixed ring of the thread that handled it, whatever the
+ * log level; the rings are saved to a file on exit and on SIGUSR1,
+ * each as an stp_trace_ring_hdr and its records oldest first, and
+ * StpTrace merges them by time. Records are in host byte order.
+ */
+#define STP_TRACE_RECORDS (1 << 16)   /* per thread, must be a power of two */
+#define STP_TRACE_MAGIC   "STPTRACE"
+#define STP_TRACE_VERSION 2
+
+typedef struct {
+  long long us;              /* stp_now_us() when the packet went or came */
+  unsigned int seqno;
+  unsigned int window;       /* raw header field, not scaled */
+  unsigned int len;          /* whole packet, header included */
+  unsigned char dir;         /* 's' or 'r' */
+  unsigned char type;        /* STP_DATA, STP_ACK, ... */
+  unsigned char version;     /* of the header */
+  unsigned char reserved;
+} stp_trace_rec;
+
+typedef struct {
+  char magic[8];             /* STP_TRACE_MAGIC, not terminated */
+  unsigned int version;      /* STP_TRACE_VERSION */
+  unsigned int recSize;      /* sizeof(stp_trace_rec) */
+  unsigned long long count;  /* records in all the rings */
+  unsigned long long lost;   /* older records the rings had overwritten */
+  long long monoUs;          /* stp_now_us() when the file was written ... */
+  long long realUs;          /* ... and the time of day then, in us */
+  unsigned int rings;        /* rings that follow, one per thread that traced */
+  unsigned int reserved;
+} stp_trace_file;
+
+typedef struct {
+  unsigned long long count;  /* records of this ring that follow */
+  unsigned long long lost;   /* older records it had overwritten */
+} stp_trace_ring_hdr;
+
+/*
+ * Timer wheel (see timer.c). Timers are embedded in the structure
+ * they belong to, so arming and cancelling never allocates.
+ */
+#define STP_TIMER_TICK_MS 1     /* resolution of the wheel */
+#define STP_TIMER_SLOTS   1024  /* must be a power of two */
+
+typedef struct stp_timer_tag {
+  struct stp_timer_tag *next;
+  struct stp_timer_tag **pprev;   /* NULL when the timer is not armed */
+  long long expires;              /* deadline in ms, see stp_now_ms() */
+  void (*fn)(struct stp_timer_tag *t, void *arg);
+  void *arg;
+} stp_timer;
+
+typedef struct {
+  stp_timer *slots[STP_TIMER_SLOTS];
+  long long lastTick;             /* last tick that has been processed */
+  int count;                      /* number of armed timers */
+} stp_timer_wheel;
+
+/*
+ * Event loop (see stp.c): a set of nonblocking sockets and a timer
+ * wheel, waited for together in one epoll_wait() (poll() where there
+ * is no epoll). Connections that run on a loop arm their timers in
+ * its wheel.
+ */
+#define STP_LOOP_MAX_FDS 64
+
+typedef struct {
+  int fd;                         /* -1 when the slot is free */
+  void (*fn)(int fd, void *arg);  /* empties fd when packets arrive */
+  void *arg;
+} stp_loop_io;
+
+typedef struct {
+  int epfd;                       /* epoll instance, -1 without epoll */
+  int nio;                        /* slots of io[] in use, free ones included */
+  stp_loop_io io[STP_LOOP_MAX_FDS];
+  stp_timer_wheel timers;         /* timers of everything on the loop */
+} stp_loop;
+
 /* This structure is used to manage received sent packets. It is not
  * the packet that is actually sent or received.
  */
@@ -42,14 +178,67 @@ typedef struct pktbuf_tag {
   
   struct pktbuf_tag *next;
   
-  unsigned short int seqno;
+  unsigned int seqno;
   int len;
-  char data[STP_MTU];
+  int retries;        /* sender: number of times it was retransmitted */
+  long long sentAt;   /* sender: time of the latest transmission (ms) */
+  int sacked;         /* sender: receiver reported it in a SACK block */
+  int unsent;         /* sender: the batch had no room for its latest transmission */
+  stp_timer timer;    /* sender: retransmission timer */
+  char *payload;      /* sender: the bytes to send, data[] or the caller's memory */
+  char data[];        /* room for one MSS, see pktpool.c */
   
 } pktbuf;
 
+/*
+ * A per-connection pool of pktbufs carved out of one slab (see
+ * pktpool.c).
+ */
+#define STP_CACHE_LINE 64
+
+typedef struct {
+  char *slab;              /* backing memory, cache-line aligned */
+  pktbuf *freeList;        /* buffers ready to be handed out */
+  int stride;              /* bytes per buffer, multiple of STP_CACHE_LINE */
+  int capacity;            /* number of buffers in the slab */
+  int dataSize;            /* payload bytes each buffer can hold */
+  int inUse;               /* buffers currently handed out */
+  int highWater;           /* largest inUse seen */
+  unsigned long allocs;    /* successful stp_pool_get() calls */
+  unsigned long failures;  /* stp_pool_get() calls on an empty pool */
+} stp_pktpool;
+
+/*
+ * The receiver's output writer (see writer.c): a byte ring between
+ * the network thread, which appends in-order data, and a thread that
+ * writes it to the file in large chunks. head and tail count bytes
+ * since the start of the stream; each is written by one thread only
+ * and lives on its own cache line.
+ */
+#define STP_WRITER_CHUNK (64 * 1024)       /* unit of the writes to the file */
+#define STP_WRITER_SIZE  (4 * 1024 * 1024) /* default size of the ring */
 
-/* This is the actual definition of the packet header on the
+typedef struct {
+  unsigned long long head __attribute__((aligned(STP_CACHE_LINE))); /* network thread */
+  unsigned long long tail __attribute__((aligned(STP_CACHE_LINE))); /* writer thread */
+  char *ring __attribute__((aligned(STP_CACHE_LINE)));
+  unsigned int size;         /* bytes in the ring, a multiple of STP_WRITER_CHUNK */
+  unsigned int chunk;        /* unit of the writes, at most half the ring */
+  int fd;                    /* file the data goes to */
+  pthread_t thread;
+  pthread_mutex_t lock;      /* only for going to sleep and waking up */
+  pthread_cond_t wake;
+  int writerWaiting;         /* the writer thread sleeps until there is a chunk */
+  int netWaiting;            /* the network thread sleeps until there is room */
+  int closing;               /* no more data, write out the rest and stop */
+  int error;                 /* errno of a failed write, 0 if none */
+  unsigned long writes;      /* write() calls */
+  unsigned long stalls;      /* times the network thread had to wait for room */
+  unsigned int highWater;    /* largest backlog seen */
+} stp_writer;
+
+
+/* This is the actual definition of the v1 packet header on the
  * wire. Note there is an extra field (data_octets) to be used as the
  * area where the data is actually stored.
  */
@@ -58,52 +247,348 @@ typedef struct {
   unsigned short int window; 
   unsigned short int seqno;
   unsigned char checksum;
+  unsigned char reserved;
+  unsigned int tsval;   /* sender's clock when the packet was sent */
+  unsigned int tsecr;   /* tsval echoed back by the peer, 0 if none */
   unsigned char data_octets[];
 } stp_header;
 
+/*
+ * The v2 header. The first byte is the version, which is always 0 in
+ * a v1 header (the high byte of its type), so either kind can be told
+ * apart without knowing what the connection negotiated. The options
+ * follow the fixed part and are padded with STP_OPT_END to a multiple
+ * of 4 bytes; hlen covers both. Data packets carry no options, so on
+ * the fast path the header is exactly sizeof(stp_header_v2) bytes.
+ */
+typedef struct {
+  unsigned char version;     /* STP_VERSION_2 */
+  unsigned char type;
+  unsigned short int window; /* advertised window >> the sender's window scale */
+  unsigned int seqno;        /* first byte of a DATA, next byte expected in an ACK */
+  unsigned int tsval;
+  unsigned int tsecr;
+  unsigned int checksum;     /* of header and data, computed as cksum says */
+  unsigned short int hlen;   /* bytes of header, options included */
+  unsigned char cksum;       /* STP_CKSUM_SUM or STP_CKSUM_CRC32C */
+  unsigned char reserved;
+  unsigned char options[];
+} stp_header_v2;
+
+/*
+ * Checksum algorithms of a v2 packet. Both cover the whole header,
+ * with the checksum field zero, and the data. The byte sum is what a
+ * v1 header has, widened to 32 bits; CRC32C is used when both sides
+ * asked for it in the SYN. A v1 header always has the 8-bit sum.
+ */
+#define STP_CKSUM_SUM    0
+#define STP_CKSUM_CRC32C 1
+
+/*
+ * A packet with its header decoded, whatever its version. Sequence
+ * numbers are 32 bits; a v1 header only carries the low 16 bits,
+ * which are extended relative to a reference close to them (see
+ * stp_decode()). The window is the raw header field, not yet scaled.
+ * The options of a v1 packet are its payload, for a SYN or an ACK.
+ */
+typedef struct {
+  int version;
+  int cksum;                 /* v2 only: STP_CKSUM_SUM or STP_CKSUM_CRC32C */
+  int type;
+  unsigned int seqno;
+  unsigned int window;
+  unsigned int tsval;
+  unsigned int tsecr;        /* on output, tsval is filled in by stp_encode() */
+  char *opts;
+  int optsLen;
+  char *data;
+  int len;
+} stp_pkt;
+
+#define STP_TRUNCATED (-4)   /* stp_decode(): shorter than its header */
+#define STP_CORRUPTED (-5)   /* stp_decode(): checksum or format is wrong */
+
+/*
+ * Options. The payload of SYN and ACK packets is a list of options,
+ * each a kind byte, a length byte (of the whole option) and the value.
+ * Unknown kinds are skipped, so peers that do not know an option
+ * simply ignore it.
+ */
+#define STP_OPT_END   0   /* no value, ends the list */
+#define STP_OPT_MSS   1   /* 16-bit MSS, SYN and SYN-ACK */
+#define STP_OPT_SACK  2   /* list of stp_sack_block, ACK */
+#define STP_OPT_VERSION 3 /* 8-bit highest version spoken, SYN and SYN-ACK */
+#define STP_OPT_WSCALE  4 /* 8-bit shift of our advertised window, SYN and SYN-ACK */
+#define STP_OPT_CKSUM   5 /* 8-bit STP_CKSUM_* wanted (SYN) or agreed (SYN-ACK), v2 */
+#define STP_OPT_SIZE    6 /* 64-bit size of the whole transfer, high word first, SYN */
+#define STP_OPT_STRIPE  7 /* 32-bit transfer number, then the 64-bit file offset of the
+                             data, high word first: this is a stripe of a file, SYN */
+
+#define STP_MAX_OPTIONS 256  /* room for the options of one packet */
+#define STP_MAX_HEADER ((int)sizeof(stp_header_v2) + STP_MAX_OPTIONS)
+
+/* Room to build the header of any outgoing packet */
+typedef union {
+  stp_header v1;
+  stp_header_v2 v2;
+  unsigned char bytes[STP_MAX_HEADER];
+} stp_hdrbuf;
+
+/*
+ * Selective acknowledgement. An ACK may carry a list of these in an
+ * STP_OPT_SACK option, one for every contiguous range [start, end) of
+ * sequence space the receiver holds beyond NBE. On the wire both
+ * fields are in network byte order, 16 bits wide in v1 and 32 in v2
+ * (see stp_put_sack()).
+ */
+#define STP_MAX_SACK_BLOCKS 16
+
+typedef struct {
+  unsigned int start;
+  unsigned int end;
+} stp_sack_block;
+
 /* 
  * All of the receiver's state is stored in the following structure,
  * including the received messages, which have to be delivered to
- * ReceiveApp in order.
+ * ReceiveApp in order. A receiver that serves many senders on one
+ * socket has one per sender, found by its address (see
+ * receiver_conn.c).
  */
-typedef struct {
+typedef struct stp_recv_ctrl_blk_tag {
   int state;                 /* protocol state: normally ESTABLISHED */
-  int fd;                    /* UDP socket descriptor */
+  int fd;                    /* UDP socket descriptor, maybe shared with other connections */
+  struct sockaddr_in peer;   /* the sender's address, where ACKs go */
+  struct stp_recv_ctrl_blk_tag *hashNext; /* next connection in the same hash bucket */
+  long long lastHeard;       /* stp_now_ms() when the latest packet arrived */
   
-  unsigned short rwnd;       /* latest advertised window */
+  unsigned int rwnd;         /* latest advertised window */
   
-  unsigned short NBE;        /* next byte expected */
-  unsigned short LBRead;     /* last byte read */
-  unsigned short LBReceived; /* last byte received */
+  unsigned int NBE;          /* next byte expected */
+  unsigned int LBRead;       /* last byte read */
+  unsigned int LBReceived;   /* last byte received */
+
+  unsigned int ISN;          /* initial sequence number */
+  int mss;                   /* negotiated maximum segment size */
+  int version;               /* negotiated wire version */
+  int wscale;                /* shift applied to the window we advertise */
+  int cksum;                 /* negotiated checksum algorithm (v2) */
+  int maxWin;                /* receive window, bounded by what the version allows */
 
-  unsigned short ISN;        /* initial sequence number */
+  unsigned int tsRecent;     /* tsval to echo in the next ACK */
+  int ackNow;                /* the next ACK must not be delayed */
+  int unackedSegs;           /* in-order segments not ACKed yet */
+  unsigned int lastAdvertised; /* window in the latest ACK */
+  stp_loop *loop;            /* event loop, holds the delayed ACK and window timers */
+  stp_timer ackTimer;        /* sends the delayed ACK */
+  stp_timer windowTimer;     /* watches the window reopen as the writer drains */
 
-  pktbuf *recvQueue;         /* Pointer to the first node of the receive queue */
+  pktbuf **recvQueue;        /* reorder window, see receiver_list.c */
+  int recvQueueSize;         /* number of slots in recvQueue */
+  int recvQueueHead;         /* slot of the segment starting at recvQueueBase */
+  unsigned int recvQueueBase; /* sequence number that maps to recvQueueHead */
+  int recvQueueCount;        /* number of buffered packets */
+  stp_pktpool recvPool;      /* buffers for the packets in recvQueue */
+
+  int outFd;                 /* the output file, -1 until the SYN */
+  stp_writer *writer;        /* the thread writing outFd, if not direct */
+  int direct;                /* no recvQueue: data is placed in the file, see receiver_map.c */
+  long long fileSize;        /* size announced in the SYN, -1 if none */
+  long long nbeOffset;       /* file offset of NBE, from fileBase */
+  long long fileBase;        /* a stripe: file offset of the first byte, else -1 */
+  unsigned int transfer;     /* a stripe: the file it is part of */
+  char *outMap;              /* the output file mapped, NULL to use pwrite() */
+  unsigned char *placed;     /* bitmap of the MSS blocks already in the file */
 
 } stp_recv_ctrl_blk;
 
+/*
+ * The connections of a receiver, hashed on the sender's address and
+ * port (see receiver_conn.c).
+ */
+typedef struct {
+  stp_recv_ctrl_blk **buckets;
+  int mask;                  /* buckets - 1, buckets being a power of two */
+  int count;                 /* connections in the table */
+} stp_conn_table;
+
+
+/*
+ * Congestion control (see cc.c). An algorithm is a set of callbacks
+ * the sender invokes on its ACK, loss and timeout events; it keeps
+ * cwnd, in bytes, in the stp_cc of the connection.
+ */
+typedef struct stp_cc_tag stp_cc;
+
+typedef struct {
+  const char *name;
+  void (*init)(stp_cc *cc);
+  /* "acked" bytes of new data were cumulatively acknowledged */
+  void (*on_ack)(stp_cc *cc, unsigned int acked, int srtt, long long now);
+  /* a loss was detected while the ACK clock keeps running */
+  void (*on_loss)(stp_cc *cc, unsigned int inFlight, long long now);
+  /* a retransmission timer expired */
+  void (*on_timeout)(stp_cc *cc, unsigned int inFlight, long long now);
+} stp_cc_ops;
+
+struct stp_cc_tag {
+  const stp_cc_ops *ops;
+  int mss;
+  unsigned int cwnd;         /* congestion window, bytes */
+  unsigned int maxCwnd;      /* cwnd never grows beyond this */
+  unsigned int ssthresh;     /* slow start threshold, bytes */
+  unsigned int bytesAcked;   /* acknowledged bytes not yet turned into cwnd */
+  unsigned long losses;      /* on_loss() calls */
+  unsigned long timeouts;    /* on_timeout() calls */
+  /* CUBIC, in segments and seconds */
+  double wMax;               /* window before the last reduction */
+  double wLastMax;           /* wMax before that, for fast convergence */
+  double wEst;               /* window AIMD would have by now */
+  double k;                  /* time for the cubic to climb back to wMax */
+  double origin;             /* window the cubic is centred on */
+  long long epochStart;      /* start of this congestion avoidance epoch, 0 if none */
+};
+
+/*
+ * A batch of datagrams for sendmmsg()/recvmmsg() (see stp.c).
+ */
+#define STP_BATCH_MAX 32
+
+#if !defined(__linux__)
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+#define STP_ZEROCOPY_MIN 4096   /* smallest payload worth MSG_ZEROCOPY */
+
+typedef struct {
+  int fd;
+  int count;                              /* packets in the batch */
+  int zerocopy;                           /* use MSG_ZEROCOPY for large packets */
+  int txtime;                             /* stamp packets with SO_TXTIME departure times */
+  unsigned long long txctrl[STP_BATCH_MAX][4]; /* SCM_TXTIME control message of each packet */
+  int error;                              /* errno of a send that failed, 0 if none */
+  int full;                               /* the socket buffer was full at the latest flush */
+  struct mmsghdr msgs[STP_BATCH_MAX];
+  struct iovec iov[STP_BATCH_MAX][2];     /* header, data */
+  stp_hdrbuf hdrs[STP_BATCH_MAX];         /* headers of outgoing packets */
+  int mtu;                                /* size of each incoming buffer */
+  unsigned char *bufs;                    /* incoming packets, mtu bytes each */
+  struct sockaddr_in from[STP_BATCH_MAX]; /* where each incoming packet came from */
+} stp_batch;
 
 /* Declarations for STP.C */
 
-void sendpkt(int fd, int type, unsigned short window, unsigned short seqno, char* data, int len);
-void sendpkt2(int fd, int type, unsigned short window, unsigned short seqno, char* data, int len, int corrupted);
+int sendpkt(int fd, int type, unsigned short window, unsigned short seqno, char* data, int len);
+int sendpkt2(int fd, int type, unsigned short window, unsigned short seqno, char* data, int len, int corrupted);
+int stp_sendpkt(int fd, stp_pkt *p, int corrupted);
+int stp_sendpkt_to(int fd, stp_pkt *p, int corrupted, struct sockaddr_in *to);
+int stp_encode(stp_hdrbuf *hdr, stp_pkt *p);
+int stp_decode(stp_pkt *p, void *pkt, int len, unsigned int ref);
+unsigned int stp_seq_extend(unsigned short wire, unsigned int ref);
+int stp_batch_init(stp_batch *batch, int fd, int mtu);
+void stp_batch_destroy(stp_batch *batch);
+unsigned char *stp_batch_pkt(stp_batch *batch, int i);
+int stp_batch_zerocopy(stp_batch *batch);
+int stp_batch_txtime(stp_batch *batch);
+int stp_batch_add(stp_batch *batch, stp_pkt *p, long long departUs);
+int stp_batch_flush(stp_batch *batch);
+int stp_batch_recv(stp_batch *batch, int ms);
+int stp_batch_len(stp_batch *batch, int i);
+struct sockaddr_in *stp_batch_from(stp_batch *batch, int i);
 int readpkt(int fd, void* pkt, int len);
 void dump(char dir, void* pkt, int len);
+void stp_peek(void *pkt, int *version, int *type, unsigned int *seqno, unsigned int *window);
 unsigned int hostname_to_ipaddr(const char *s);
-int readWithTimer(int fd, char *pkt, int ms);
-void reset(int fd);
+int readWithTimer(int fd, char *pkt, int len, int ms);
+int nonblock(int fd);
+int stp_loop_init(stp_loop *loop);
+void stp_loop_destroy(stp_loop *loop);
+int stp_loop_add(stp_loop *loop, int fd, void (*fn)(int fd, void *arg), void *arg);
+void stp_loop_del(stp_loop *loop, int fd);
+int stp_loop_run(stp_loop *loop, int ms);
+int reset(int fd);
 unsigned char checksum(stp_header *stpHeader, int len);
+unsigned char checksum_iov(stp_header *stpHeader, char *data, int len);
+int stp_put_option(char *opts, int off, int kind, void *val, int len);
+int stp_get_option(char *opts, int optsLen, int kind, void *val, int len);
+int stp_put_sack(char *opts, int off, int version, stp_sack_block *blocks, int n);
+int stp_get_sack(char *opts, int optsLen, int version, unsigned int ref,
+                 stp_sack_block *blocks, int max);
+int stp_path_mtu(int fd, int mtu);
+long long stp_now_ms(void);
+long long stp_now_us(void);
+unsigned int stp_timestamp(void);
+
+/* Declarations for CC.C */
+const stp_cc_ops *stp_cc_find(const char *name);
+void stp_cc_init(stp_cc *cc, const stp_cc_ops *ops, int mss, unsigned int maxWin);
+void stp_cc_ack(stp_cc *cc, unsigned int acked, unsigned int inFlight, int srtt, long long now);
+unsigned int stp_cc_ssthresh(stp_cc *cc);
+
+/* Declarations for CRC32C.C */
+unsigned int stp_crc32c(unsigned int crc, const void *buf, int len);
+const char *stp_crc32c_impl(void);
+
+/* Declarations for RECEIVER_CONN.C */
+int stp_conn_table_init(stp_conn_table *table, int buckets);
+void stp_conn_table_destroy(stp_conn_table *table);
+stp_recv_ctrl_blk *stp_conn_find(stp_conn_table *table, struct sockaddr_in *peer);
+void stp_conn_insert(stp_conn_table *table, stp_recv_ctrl_blk *conn);
+void stp_conn_remove(stp_conn_table *table, stp_recv_ctrl_blk *conn);
 
 /* Declarations for RECEIVER_LIST.C */
-void add_packet(stp_recv_ctrl_blk *info, unsigned short seqno, int len, char *data);
-pktbuf *get_packet(stp_recv_ctrl_blk *info, unsigned short seqno);
-void free_packet(pktbuf *pbuf);
+int init_packet_queue(stp_recv_ctrl_blk *info, int capacity);
+void free_packet_queue(stp_recv_ctrl_blk *info);
+int add_packet(stp_recv_ctrl_blk *info, unsigned int seqno, int len, char *data);
+pktbuf *get_packet(stp_recv_ctrl_blk *info, unsigned int seqno);
+void free_packet(stp_recv_ctrl_blk *info, pktbuf *pbuf);
+void advance_packet_queue(stp_recv_ctrl_blk *info, unsigned int nbe);
+int get_sack_blocks(stp_recv_ctrl_blk *info, stp_sack_block *blocks, int max);
+
+/* Declarations for RECEIVER_MAP.C */
+int init_output_map(stp_recv_ctrl_blk *info, int fd, long long size);
+int place_packet(stp_recv_ctrl_blk *info, unsigned int seqno, int len, char *data);
+unsigned int advance_output_map(stp_recv_ctrl_blk *info, int len);
+int get_map_sack_blocks(stp_recv_ctrl_blk *info, stp_sack_block *blocks, int max);
+int close_output_map(stp_recv_ctrl_blk *info);
+
+/* Declarations for PKTPOOL.C */
+int stp_pool_init(stp_pktpool *pool, int capacity, int dataSize);
+void stp_pool_destroy(stp_pktpool *pool);
+pktbuf *stp_pool_get(stp_pktpool *pool);
+void stp_pool_put(stp_pktpool *pool, pktbuf *p);
+int stp_pool_empty(stp_pktpool *pool);
+void stp_pool_stats(stp_pktpool *pool, const char *name);
+
+/* Declarations for TIMER.C */
+void stp_timer_wheel_init(stp_timer_wheel *wheel, long long now);
+void stp_timer_init(stp_timer *t, void (*fn)(stp_timer *, void *), void *arg);
+void stp_timer_arm(stp_timer_wheel *wheel, stp_timer *t, long long expires);
+void stp_timer_cancel(stp_timer_wheel *wheel, stp_timer *t);
+int stp_timer_pending(stp_timer *t);
+void stp_timer_expire(stp_timer_wheel *wheel, long long now);
+int stp_timer_next_ms(stp_timer_wheel *wheel, long long now);
+
+/* Declarations for TRACE.C */
+void stp_trace(char dir, void *pkt, int len);
+int stp_trace_open(const char *path);
+int stp_trace_save(void);
+
+/* Declarations for WRITER.C */
+int stp_writer_init(stp_writer *w, int fd, unsigned int size);
+int stp_writer_put(stp_writer *w, const char *data, int len);
+unsigned int stp_writer_room(stp_writer *w);
+int stp_writer_close(stp_writer *w);
+void stp_writer_stats(stp_writer *w);
 
 /* Declarations for WRAPAROUND.C */
-int greater(unsigned short val1, 
-	    unsigned short val2);
-unsigned short minus(unsigned short greaterVal, 
-		     unsigned short lesserVal);
-unsigned short plus(unsigned short val1,  unsigned short val2);
+int greater(unsigned int val1, 
+	    unsigned int val2);
+unsigned int minus(unsigned int greaterVal, 
+		   unsigned int lesserVal);
+unsigned int plus(unsigned int val1,  unsigned int val2);
 
 #endif
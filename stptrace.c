@@ -0,0 +1,157 @@
+/*
+ * StpTrace: print a packet trace saved by SendApp or ReceiveApp (see
+ * trace.c), one packet per line in the format dump() uses, preceded by
+ * the time. The rings of the threads that traced are merged into one
+ * sequence by time. Times are seconds since the first packet, or the
+ * time of day with -a. The file has to come from a machine with the
+ * same byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "stp.h"
+
+static const char *type_name(int type)
+{
+  switch (type)
+    {
+    case STP_DATA:  return "dat";
+    case STP_ACK:   return "ack";
+    case STP_SYN:   return "syn";
+    case STP_FIN:   return "fin";
+    case STP_RESET: return "reset";
+    default:        return "???";
+    }
+}
+
+/* A record and where it was in the file, to keep the order of equal times */
+typedef struct {
+  stp_trace_rec rec;
+  unsigned long long pos;
+} trace_entry;
+
+static int by_time(const void *a, const void *b)
+{
+  const trace_entry *x = (const trace_entry *) a, *y = (const trace_entry *) b;
+
+  if (x->rec.us != y->rec.us)
+    return x->rec.us < y->rec.us ? -1 : 1;
+  return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/*
+ * Read the rings that follow the header into one array, sorted by
+ * time. Returns how many records there are, or -1 (with a message)
+ * if the file ends early or there is no memory.
+ */
+static long long read_rings(FILE *f, const char *name, stp_trace_file *hdr, trace_entry **out)
+{
+  trace_entry *all = (trace_entry *) malloc((hdr->count > 0 ? hdr->count : 1) * sizeof(*all));
+  stp_trace_ring_hdr rhdr;
+  unsigned long long n = 0, i;
+  unsigned int ring;
+
+  if (all == NULL)
+    {
+      perror(name);
+      return -1;
+    }
+  for (ring = 0; ring < hdr->rings; ring++)
+    {
+      if (fread(&rhdr, sizeof(rhdr), 1, f) != 1 || rhdr.count > hdr->count - n)
+        break;
+      for (i = 0; i < rhdr.count && fread(&all[n].rec, sizeof(all[n].rec), 1, f) == 1; i++, n++)
+        all[n].pos = n;
+      if (i < rhdr.count)
+        break;
+    }
+  if (ring < hdr->rings)
+    fprintf(stderr, "%s: truncated after %llu packets\n", name, n);
+
+  qsort(all, n, sizeof(*all), by_time);
+  *out = all;
+  return (long long) n;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: StpTrace [-a] tracefile\n"
+          "  -a  print the time of day rather than the time since the first packet\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  stp_trace_file hdr;
+  trace_entry *all;
+  long long i, n, first = 0;
+  int absolute = 0, opt;
+  FILE *f;
+
+  while ((opt = getopt(argc, argv, "a")) != -1)
+    {
+      switch (opt)
+        {
+        case 'a':
+          absolute = 1;
+          break;
+        default:
+          usage();
+        }
+    }
+  if (argc - optind != 1)
+    usage();
+
+  if ((f = fopen(argv[optind], "rb")) == NULL)
+    {
+      perror(argv[optind]);
+      return 1;
+    }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, STP_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != STP_TRACE_VERSION || hdr.recSize != sizeof(stp_trace_rec))
+    {
+      fprintf(stderr, "%s: not an STP trace this program can read\n", argv[optind]);
+      return 1;
+    }
+
+  if ((n = read_rings(f, argv[optind], &hdr, &all)) < 0)
+    return 1;
+  fclose(f);
+
+  printf("# %llu packets", hdr.count);
+  if (hdr.rings > 1)
+    printf(" from %u threads", hdr.rings);
+  if (hdr.lost > 0)
+    printf(", %llu older ones lost", hdr.lost);
+  printf("\n");
+
+  for (i = 0; i < n; i++)
+    {
+      const stp_trace_rec *rec = &all[i].rec;
+
+      if (i == 0)
+        first = rec->us;
+
+      if (absolute)
+        {
+          long long us = hdr.realUs - (hdr.monoUs - rec->us);
+          time_t sec = us / 1000000;
+          char buf[32];
+
+          strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&sec));
+          printf("%s.%06lld ", buf, us % 1000000);
+        }
+      else
+        printf("%12.6f ", (rec->us - first) / 1e6);
+
+      printf("%c %s seq %u win %u len %u%s\n", rec->dir, type_name(rec->type),
+             rec->seqno, rec->window, rec->len, rec->version == STP_VERSION_1 ? " v1" : "");
+    }
+
+  free(all);
+  return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Timers for STP.
+ *
+ * A hashed timer wheel: every timer hangs off the slot for the tick
+ * in which it expires, modulo the size of the wheel. Arming and
+ * cancelling a timer is a constant-time list operation, and expiry
+ * only looks at the slots for the ticks that have passed. Timers
+ * that are more than one revolution away simply stay in their slot
+ * until the wheel comes round to them at the right time.
+ *
+ * The wheel does not use signals. The owner asks for the time until
+ * the next expiry, waits that long on its sockets (stp_loop_run() in
+ * stp.c does both), and then calls stp_timer_expire() to run whatever
+ * has fired.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "stp.h"
+
+#define TICK(ms) ((ms) / STP_TIMER_TICK_MS)
+#define SLOT(tick) ((int)((tick) & (STP_TIMER_SLOTS - 1)))
+
+static void link_timer(stp_timer_wheel *wheel, stp_timer *t)
+{
+  long long tick = TICK(t->expires);
+  stp_timer **head;
+
+  /* Anything already due goes into the next slot to be processed */
+  if (tick <= wheel->lastTick)
+    tick = wheel->lastTick + 1;
+
+  head = &wheel->slots[SLOT(tick)];
+  t->next = *head;
+  if (*head != NULL)
+    (*head)->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+}
+
+static void unlink_timer(stp_timer *t)
+{
+  *t->pprev = t->next;
+  if (t->next != NULL)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+void stp_timer_wheel_init(stp_timer_wheel *wheel, long long now)
+{
+  memset(wheel->slots, 0, sizeof(wheel->slots));
+  wheel->lastTick = TICK(now);
+  wheel->count = 0;
+}
+
+void stp_timer_init(stp_timer *t, void (*fn)(stp_timer *, void *), void *arg)
+{
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->fn = fn;
+  t->arg = arg;
+}
+
+/*
+ * Arm (or re-arm) a timer to fire at the absolute time "expires" (ms,
+ * see stp_now_ms()).
+ */
+void stp_timer_arm(stp_timer_wheel *wheel, stp_timer *t, long long expires)
+{
+  if (t->pprev != NULL)
+    unlink_timer(t);
+  else
+    wheel->count++;
+
+  t->expires = expires;
+  link_timer(wheel, t);
+}
+
+/*
+ * Cancel a timer. Cancelling a timer that is not armed is harmless.
+ */
+void stp_timer_cancel(stp_timer_wheel *wheel, stp_timer *t)
+{
+  if (t->pprev == NULL)
+    return;
+
+  unlink_timer(t);
+  wheel->count--;
+}
+
+int stp_timer_pending(stp_timer *t)
+{
+  return t->pprev != NULL;
+}
+
+/*
+ * Run every timer whose deadline is at or before "now". Callbacks may
+ * arm or cancel any timer, including the one that is firing.
+ */
+void stp_timer_expire(stp_timer_wheel *wheel, long long now)
+{
+  long long nowTick = TICK(now);
+  long long tick = wheel->lastTick;
+
+  /* After a long sleep one revolution visits every slot */
+  if (nowTick - tick > STP_TIMER_SLOTS)
+    tick = nowTick - STP_TIMER_SLOTS;
+
+  while (tick < nowTick)
+    {
+      stp_timer *list, *t;
+
+      tick++;
+      wheel->lastTick = tick;
+
+      /* Detach the slot so that callbacks re-arming into it are safe */
+      list = wheel->slots[SLOT(tick)];
+      wheel->slots[SLOT(tick)] = NULL;
+      if (list != NULL)
+        list->pprev = &list;
+
+      while ((t = list) != NULL)
+        {
+          unlink_timer(t);
+          if (t->expires <= now)
+            {
+              wheel->count--;
+              t->fn(t, t->arg);
+            }
+          else
+            link_timer(wheel, t);
+        }
+    }
+}
+
+/*
+ * Milliseconds from "now" until the next timer fires, 0 if one is
+ * already due, or -1 when no timer is armed. Only one revolution of
+ * the wheel is inspected; if everything is further away than that the
+ * caller is simply woken up once per revolution.
+ */
+int stp_timer_next_ms(stp_timer_wheel *wheel, long long now)
+{
+  long long best = -1;
+  int i;
+
+  if (wheel->count == 0)
+    return -1;
+
+  for (i = 1; i <= STP_TIMER_SLOTS && best < 0; i++)
+    {
+      long long tick = wheel->lastTick + i;
+      stp_timer *t;
+
+      for (t = wheel->slots[SLOT(tick)]; t != NULL; t = t->next)
+        if (TICK(t->expires) <= tick && (best < 0 || t->expires < best))
+          best = t->expires;
+    }
+
+  if (best < 0)
+    best = (wheel->lastTick + STP_TIMER_SLOTS) * STP_TIMER_TICK_MS;
+
+  return best <= now ? 0 : (int)(best - now);
+}
@@ -0,0 +1,191 @@
+/*
+ * Logging level and packet trace for STP.
+ *
+ * Printing every packet costs a printf() and an fflush() each, which
+ * at any real packet rate is more than the protocol itself. Instead,
+ * stp_trace() stores a small binary record of the packet in a ring of
+ * STP_TRACE_RECORDS entries and only prints it at STP_LOG_PKT. Each
+ * thread that traces gets a ring of its own the first time it does,
+ * so the receiver's shards and the sender's stripes never touch each
+ * other's cache lines; once a ring is full its oldest records are
+ * overwritten. A ring outlives its thread, and its records stay in
+ * the trace.
+ *
+ * If stp_trace_open() has named a file, the rings are written to it
+ * when the process exits and whenever it gets SIGUSR1, so a trace of
+ * the latest packets can be had from a running transfer. Saving uses
+ * only open()/write()/close() and may run in the signal handler; a
+ * record being written at that moment may come out torn. StpTrace
+ * (stptrace.c) decodes the file and merges the rings.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "stp.h"
+
+int stp_log_level = STP_LOG_INFO;
+
+#define TRACE_MAX_RINGS 1024   /* rings saved; one per thread that traced */
+
+typedef struct stp_trace_ring {
+  stp_trace_rec recs[STP_TRACE_RECORDS];
+  unsigned long long next;      /* records ever written, only by its thread */
+  struct stp_trace_ring *link;  /* the ring of the thread that traced before */
+} stp_trace_ring;
+
+static __thread stp_trace_ring *traceRing;  /* this thread's, NULL until it traces */
+static stp_trace_ring *traceRings;          /* every thread's, newest first */
+static char tracePath[1024];                /* empty: do not save */
+
+/*
+ * This thread's ring, made and added to traceRings the first time.
+ * Returns NULL if there is no memory for it.
+ */
+static stp_trace_ring *trace_ring(void)
+{
+  void *mem;
+  stp_trace_ring *ring;
+
+  if (traceRing != NULL)
+    return traceRing;
+  if (posix_memalign(&mem, STP_CACHE_LINE, sizeof(stp_trace_ring)) != 0)
+    return NULL;
+  ring = (stp_trace_ring *) mem;
+  ring->next = 0;
+  ring->link = __atomic_load_n(&traceRings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&traceRings, &ring->link, ring, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return traceRing = ring;
+}
+
+/*
+ * Record a packet that was sent (dir 's') or received ('r'); len is
+ * that of the whole packet.
+ */
+void stp_trace(char dir, void *pkt, int len)
+{
+  stp_trace_ring *ring = trace_ring();
+  stp_trace_rec *rec;
+  int version, type;
+
+  if (ring == NULL)
+    return;
+  rec = &ring->recs[ring->next & (STP_TRACE_RECORDS - 1)];
+
+  stp_peek(pkt, &version, &type, &rec->seqno, &rec->window);
+  rec->us = stp_now_us();
+  rec->len = len;
+  rec->dir = dir;
+  rec->type = type;
+  rec->version = version;
+  rec->reserved = 0;
+  __atomic_store_n(&ring->next, ring->next + 1, __ATOMIC_RELEASE);
+
+  if (STP_LOG_PKT <= STP_LOG_COMPILED && stp_log_level >= STP_LOG_PKT)
+    dump(dir, pkt, len);
+}
+
+/*
+ * Write one ring, "next" records having been written to it, as its
+ * header and then its records, oldest first. Returns nonzero if that
+ * went well.
+ */
+static int trace_save_ring(int fd, stp_trace_ring *ring, unsigned long long next)
+{
+  stp_trace_ring_hdr rhdr;
+  unsigned long long count = next < STP_TRACE_RECORDS ? next : STP_TRACE_RECORDS;
+  unsigned int first = (unsigned int) ((next - count) & (STP_TRACE_RECORDS - 1));
+  unsigned int tail = STP_TRACE_RECORDS - first;
+
+  rhdr.count = count;
+  rhdr.lost = next - count;
+
+  /* The oldest record is at "first"; the ring may wrap after it */
+  if (tail > count)
+    tail = count;
+  return write(fd, &rhdr, sizeof(rhdr)) == sizeof(rhdr) &&
+    write(fd, &ring->recs[first], tail * sizeof(stp_trace_rec)) ==
+    (ssize_t) (tail * sizeof(stp_trace_rec)) &&
+    write(fd, ring->recs, (count - tail) * sizeof(stp_trace_rec)) ==
+    (ssize_t) ((count - tail) * sizeof(stp_trace_rec));
+}
+
+/*
+ * Write the rings to the file named by stp_trace_open(). Returns 0, or
+ * -1 if there is no such file or it could not be written.
+ */
+int stp_trace_save(void)
+{
+  stp_trace_file hdr;
+  struct timeval now;
+  stp_trace_ring *rings = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE), *ring;
+  unsigned long long next[TRACE_MAX_RINGS];
+  unsigned int i;
+  int fd, ok;
+
+  if (tracePath[0] == '\0')
+    return -1;
+  if ((fd = open(tracePath, O_CREAT | O_WRONLY | O_TRUNC, 0644)) < 0)
+    return -1;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, STP_TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = STP_TRACE_VERSION;
+  hdr.recSize = sizeof(stp_trace_rec);
+  /* The rings are saved as far as they had got here; a thread may trace on */
+  for (ring = rings; ring != NULL && hdr.rings < TRACE_MAX_RINGS; ring = ring->link)
+    {
+      next[hdr.rings] = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+      hdr.count += next[hdr.rings] < STP_TRACE_RECORDS ? next[hdr.rings] : STP_TRACE_RECORDS;
+      hdr.lost += next[hdr.rings] < STP_TRACE_RECORDS ? 0 : next[hdr.rings] - STP_TRACE_RECORDS;
+      hdr.rings++;
+    }
+  gettimeofday(&now, NULL);
+  hdr.monoUs = stp_now_us();
+  hdr.realUs = (long long) now.tv_sec * 1000000 + now.tv_usec;
+
+  ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+  for (ring = rings, i = 0; ok && i < hdr.rings; ring = ring->link, i++)
+    ok = trace_save_ring(fd, ring, next[i]);
+
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+static void trace_exit(void)
+{
+  if (stp_trace_save() < 0)
+    perror(tracePath);
+}
+
+static void trace_signal(int sig)
+{
+  stp_trace_save();
+}
+
+/*
+ * Save the trace to "path" on exit and on SIGUSR1. Returns 0, or -1
+ * if the name is too long.
+ */
+int stp_trace_open(const char *path)
+{
+  struct sigaction sa;
+
+  if (strlen(path) >= sizeof(tracePath))
+    return -1;
+  strcpy(tracePath, path);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  atexit(trace_exit);
+  return 0;
+}
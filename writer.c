@@ -0,0 +1,236 @@
+/*
+ * Output writer for the STP receiver.
+ *
+ * The network thread must never wait for the disk, so delivered data
+ * is not written to the file where it arrives. It is appended to a
+ * ring and a writer thread writes it out, STP_WRITER_CHUNK bytes (or
+ * half the ring, if that is less) at a time at chunk-aligned file
+ * offsets, until the connection closes and the rest is flushed. The
+ * window can never hold more than the room in the ring, so the writer
+ * must not wait for a chunk that cannot fill up.
+ *
+ * There is exactly one producer and one consumer. The network thread
+ * only moves head and the writer thread only moves tail, so the data
+ * path needs no lock: a release store of one index publishes the
+ * bytes (or the room) behind it to the acquire load on the other
+ * side. The mutex and condition variable are only used to go to sleep
+ * when there is nothing to do and to wake the other side up again.
+ *
+ * The room left in the ring bounds the receive window (see
+ * receiver.c), so a sender that respects the window never makes the
+ * network thread wait here.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "stp.h"
+
+#define LOAD(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define LOAD_SC(p)   __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE_SC(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+
+/*
+ * Sleep until ready(w) is true. The flag is set before ready() is
+ * checked again and the other side stores its index before it looks
+ * at the flag, so one of the two always sees the other and a wakeup
+ * cannot be lost.
+ */
+static void writer_wait(stp_writer *w, int *flag, int (*ready)(stp_writer *))
+{
+  pthread_mutex_lock(&w->lock);
+  STORE_SC(flag, 1);
+  while (!ready(w))
+    pthread_cond_wait(&w->wake, &w->lock);
+  STORE_SC(flag, 0);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void writer_wakeup(stp_writer *w, int *flag)
+{
+  if (LOAD_SC(flag))
+    {
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_broadcast(&w->wake);
+      pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* Writer thread: a whole chunk is waiting, or everything must go out */
+static int writer_has_work(stp_writer *w)
+{
+  return LOAD_SC(&w->head) - w->tail >= w->chunk || LOAD_SC(&w->closing);
+}
+
+/* Network thread: the writer made room, or gave up */
+static int writer_has_room(stp_writer *w)
+{
+  return w->head - LOAD_SC(&w->tail) < w->size || LOAD_SC(&w->error);
+}
+
+static void *writer_thread(void *arg)
+{
+  stp_writer *w = (stp_writer *) arg;
+
+  while (1)
+    {
+      unsigned long long head = LOAD(&w->head);
+      unsigned int off = (unsigned int) (w->tail % w->size);
+      unsigned long long len = head - w->tail;
+      ssize_t n;
+
+      /* Whole chunks only, unless this is the end of the stream */
+      if (len < w->chunk)
+        {
+          if (!LOAD(&w->closing))
+            {
+              writer_wait(w, &w->writerWaiting, writer_has_work);
+              continue;
+            }
+          if (len == 0)
+            break;
+        }
+      else
+        len -= len % w->chunk;
+      if (len > w->size - off)
+        len = w->size - off;
+
+      n = write(w->fd, w->ring + off, len);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          STORE_SC(&w->error, errno);
+          break;
+        }
+      w->writes++;
+      STORE_SC(&w->tail, w->tail + n);
+      writer_wakeup(w, &w->netWaiting);
+    }
+
+  /* Let a network thread waiting for room see the error */
+  writer_wakeup(w, &w->netWaiting);
+  return NULL;
+}
+
+/*
+ * Start a writer with a ring of "size" bytes, rounded up to a whole
+ * number of chunks, that writes to fd. Returns 0 on success, -1 if
+ * the ring or the thread could not be created.
+ */
+int stp_writer_init(stp_writer *w, int fd, unsigned int size)
+{
+  void *ring;
+
+  memset(w, 0, sizeof(*w));
+  size = (size + STP_WRITER_CHUNK - 1) / STP_WRITER_CHUNK * STP_WRITER_CHUNK;
+  if (size == 0 || posix_memalign(&ring, 4096, size) != 0)
+    return -1;
+
+  w->ring = (char *) ring;
+  w->size = size;
+  w->chunk = size / 2 < STP_WRITER_CHUNK ? size / 2 : STP_WRITER_CHUNK;
+  w->fd = fd;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  if (pthread_create(&w->thread, NULL, writer_thread, w) != 0)
+    {
+      free(w->ring);
+      w->ring = NULL;
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * Append len bytes to the output. Only waits if the ring is full,
+ * which does not happen while the sender keeps to our window.
+ * Returns 0, or -1 if the writer thread failed to write.
+ */
+int stp_writer_put(stp_writer *w, const char *data, int len)
+{
+  unsigned long long backlog;
+
+  while (len > 0)
+    {
+      unsigned int off = (unsigned int) (w->head % w->size);
+      unsigned int room = w->size - (unsigned int) (w->head - LOAD(&w->tail));
+      unsigned int n = len;
+
+      if (LOAD(&w->error))
+        {
+          errno = w->error;
+          return -1;
+        }
+      if (room == 0)
+        {
+          w->stalls++;
+          writer_wakeup(w, &w->writerWaiting);
+          writer_wait(w, &w->netWaiting, writer_has_room);
+          continue;
+        }
+
+      if (n > room)
+        n = room;
+      if (n > w->size - off)
+        n = w->size - off;
+      memcpy(w->ring + off, data, n);
+      STORE_SC(&w->head, w->head + n);
+      data += n;
+      len -= n;
+    }
+
+  backlog = w->head - LOAD(&w->tail);
+  if (backlog > w->highWater)
+    w->highWater = (unsigned int) backlog;
+  if (backlog >= w->chunk)
+    writer_wakeup(w, &w->writerWaiting);
+  return 0;
+}
+
+/*
+ * Bytes that can be appended without waiting for the writer thread.
+ */
+unsigned int stp_writer_room(stp_writer *w)
+{
+  return w->size - (unsigned int) (w->head - LOAD(&w->tail));
+}
+
+/*
+ * Write out whatever is left and stop the writer thread. Returns 0 if
+ * all the data reached the file, -1 (with errno set) if not.
+ */
+int stp_writer_close(stp_writer *w)
+{
+  int error;
+
+  if (w->ring == NULL)
+    return 0;
+
+  STORE_SC(&w->closing, 1);
+  writer_wakeup(w, &w->writerWaiting);
+  pthread_join(w->thread, NULL);
+
+  error = w->error;
+  free(w->ring);
+  w->ring = NULL;
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->wake);
+  if (error != 0)
+    {
+      errno = error;
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * Print the writer counters.
+ */
+void stp_writer_stats(stp_writer *w)
+{
+  printf("writer: %llu bytes in %lu writes, ring %u bytes, high water %u, %lu stalls\n",
+         w->tail, w->writes, w->size, w->highWater, w->stalls);
+}